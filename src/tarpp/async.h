@@ -0,0 +1,308 @@
+#pragma once
+
+#ifndef TAR_ASYNC_H
+#define TAR_ASYNC_H
+
+#if defined(__has_include)
+#if __has_include(<coroutine>) && defined(__cpp_impl_coroutine)
+#define TARPP_HAS_COROUTINES 1
+#endif
+#endif
+
+#ifdef TARPP_HAS_COROUTINES
+
+#include <cerrno>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "io.h"
+#include "tar.h"
+
+/**
+ * Coroutine interface for archive creation (C++20), for use inside event loops.
+ *
+ * An async sink provides:
+ *     size_t try_write(const char *data, size_t size);   // write without blocking, return the count (0 if none)
+ *     Awaitable writable();                              // resume once try_write can make progress
+ */
+
+namespace tarpp {
+namespace async {
+
+/**
+ * Lazily started coroutine, run when awaited. Exceptions are rethrown to the awaiting coroutine.
+ */
+class Task
+{
+public:
+    struct promise_type
+    {
+        Task get_return_object()
+        {
+            return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        auto final_suspend() noexcept
+        {
+            struct FinalAwaiter
+            {
+                bool await_ready() noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+                {
+                    auto continuation = handle.promise().continuation;
+                    return continuation ? continuation : std::noop_coroutine();
+                }
+
+                void await_resume() noexcept {}
+            };
+            return FinalAwaiter{};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception() { error = std::current_exception(); }
+
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+    };
+
+    Task(Task &&other) noexcept :
+        handle_{std::exchange(other.handle_, nullptr)}
+    {}
+
+    Task &operator=(Task &&other) noexcept
+    {
+        std::swap(handle_, other.handle_);
+        return *this;
+    }
+
+    ~Task()
+    {
+        if (handle_)
+        {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+    {
+        handle_.promise().continuation = continuation;
+        return handle_;
+    }
+
+    void await_resume() const { rethrow(); }
+
+    /**
+     * Start the task from outside of a coroutine. It runs until its first suspension.
+     */
+    void start() { handle_.resume(); }
+
+    bool done() const noexcept { return !handle_ || handle_.done(); }
+
+    /**
+     * Rethrow the exception the task completed with, if any.
+     */
+    void rethrow() const
+    {
+        if (handle_ && handle_.promise().error)
+        {
+            std::rethrow_exception(handle_.promise().error);
+        }
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) :
+        handle_{handle}
+    {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+} // async
+
+namespace sink {
+
+/**
+ * Async sink writing to a file descriptor switched to non-blocking mode. When the descriptor is full, the coroutine
+ * is handed to watch(fd, handle), which must resume it once fd is writable (typically by registering it with the
+ * event loop). The file descriptor is not closed by the sink.
+ */
+class NonBlockingFdSink
+{
+public:
+    using Watch = std::function<void(int fd, std::coroutine_handle<> handle)>;
+
+    NonBlockingFdSink(int fd, Watch watch) :
+        fd_{fd},
+        watch_{std::move(watch)}
+    {
+        auto flags = ::fcntl(fd, F_GETFL);
+        if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        {
+            io::details::throw_errno("tarpp: cannot make file descriptor non-blocking");
+        }
+    }
+
+    size_t try_write(const char *data, size_t size)
+    {
+        for (;;)
+        {
+            auto result = ::write(fd_, data, size);
+            if (result >= 0) return static_cast<size_t>(result);
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno != EINTR)
+            {
+                io::details::throw_errno("tarpp: cannot write to file descriptor");
+            }
+        }
+    }
+
+    auto writable()
+    {
+        struct Awaiter
+        {
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(std::coroutine_handle<> handle) const
+            {
+                sink->watch_(sink->fd_, handle);
+            }
+
+            void await_resume() const noexcept {}
+
+            NonBlockingFdSink *sink;
+        };
+        return Awaiter{this};
+    }
+
+private:
+    int fd_;
+    Watch watch_;
+};
+
+} // sink
+
+/**
+ * Tar archive writer for coroutines: add_async and finalize_async complete once the sink accepted the whole entry,
+ * suspending the calling coroutine whenever the sink would block. Headers are formatted as by BasicTar.
+ * Only one operation may be in progress at a time, and the archive is not finalized on destruction.
+ */
+template<typename Sink>
+class AsyncTar
+{
+public:
+    explicit AsyncTar(Sink sink) :
+        sink_(std::move(sink)),
+        open_{true},
+        busy_{false},
+        offset_{0}
+    {}
+
+    AsyncTar(const AsyncTar &) = delete;
+    AsyncTar &operator=(const AsyncTar &) = delete;
+
+    /**
+     * Add an entry. The arguments are copied into the coroutine, so temporaries can be passed.
+     */
+    async::Task add_async(std::string tar_name, std::string content, TarFileOptions options = TarFileOptions{})
+    {
+        using namespace details::constants;
+
+        auto operation = start_operation();
+        auto header = details::TarHeader{};
+        details::format_header(header, tar_name, content.size(), options);
+
+        static const char zeros[BLOCK_SIZE] = {};
+        co_await write_all(header.data_, HEADER_SIZE);
+        co_await write_all(content.data(), content.size());
+        co_await write_all(zeros, details::padding_size(content.size()));
+    }
+
+    /**
+     * Write the end-of-archive blocks.
+     */
+    async::Task finalize_async()
+    {
+        using namespace details::constants;
+
+        if (!open_) co_return;
+        auto operation = start_operation();
+        open_ = false;
+
+        static const char zeros[2 * BLOCK_SIZE] = {};
+        co_await write_all(zeros, sizeof(zeros));
+    }
+
+    size_t offset() const { return offset_; }
+
+    Sink &sink() { return sink_; }
+
+private:
+    /**
+     * Marks an operation as in progress until it is destroyed: when the operation completes, throws, or its task
+     * is destroyed while suspended.
+     */
+    class Operation
+    {
+    public:
+        explicit Operation(bool &busy) : busy_(busy) { busy_ = true; }
+        ~Operation() { busy_ = false; }
+
+        Operation(const Operation &) = delete;
+        Operation &operator=(const Operation &) = delete;
+
+    private:
+        bool &busy_;
+    };
+
+    Operation start_operation()
+    {
+        if (!open_)
+        {
+            throw std::logic_error("tarpp: cannot add an entry to a finalized archive");
+        }
+        if (busy_)
+        {
+            throw std::logic_error("tarpp: an operation is already in progress");
+        }
+        return Operation{busy_};
+    }
+
+    async::Task write_all(const char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            auto written = sink_.try_write(data, size);
+            if (written == 0)
+            {
+                co_await sink_.writable();
+                continue;
+            }
+            data += written;
+            size -= written;
+            offset_ += written;
+        }
+    }
+
+    Sink sink_;
+    bool open_;
+    bool busy_;
+    size_t offset_;
+};
+
+} // tarpp
+
+#endif //TARPP_HAS_COROUTINES
+
+#endif //TAR_ASYNC_H
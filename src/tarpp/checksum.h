@@ -0,0 +1,131 @@
+#pragma once
+
+#ifndef TAR_CHECKSUM_H
+#define TAR_CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TARPP_CHECKSUM_X86 1
+#include <immintrin.h>
+#endif
+
+/**
+ * Header checksums: the sum of the bytes of a 512 bytes header block, taken either as unsigned (as specified by
+ * ustar) or as signed (as computed by some historic implementations).
+ *
+ * Every kernel computes the unsigned sum of the bytes xored with a bias: with a bias of 0x80, each byte b becomes
+ * b + 128 when taken as signed, so the signed sum is that sum minus 128 * 512. The vectorized kernels use SAD
+ * (sum of absolute differences against zero) to add the bytes horizontally, and the best one supported by the CPU
+ * is selected at run time.
+ */
+
+namespace tarpp {
+namespace details {
+namespace checksum {
+
+constexpr size_t BLOCK_SIZE = 512;
+
+using Kernel = uint32_t (*)(const char *block, unsigned char bias);
+
+inline uint32_t sum_portable(const char *block, unsigned char bias)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < BLOCK_SIZE; ++i)
+    {
+        sum += static_cast<unsigned char>(block[i]) ^ bias;
+    }
+    return sum;
+}
+
+#ifdef TARPP_CHECKSUM_X86
+
+__attribute__((target("sse2")))
+inline uint32_t sum_sse2(const char *block, unsigned char bias)
+{
+    auto flip = _mm_set1_epi8(static_cast<char>(bias));
+    auto zero = _mm_setzero_si128();
+    auto total = _mm_setzero_si128();
+    for (size_t i = 0; i < BLOCK_SIZE; i += 16)
+    {
+        auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + i));
+        total = _mm_add_epi64(total, _mm_sad_epu8(_mm_xor_si128(bytes, flip), zero));
+    }
+    total = _mm_add_epi64(total, _mm_unpackhi_epi64(total, total));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(total));
+}
+
+__attribute__((target("avx2")))
+inline uint32_t sum_avx2(const char *block, unsigned char bias)
+{
+    auto flip = _mm256_set1_epi8(static_cast<char>(bias));
+    auto zero = _mm256_setzero_si256();
+    auto total = _mm256_setzero_si256();
+    for (size_t i = 0; i < BLOCK_SIZE; i += 32)
+    {
+        auto bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block + i));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_xor_si256(bytes, flip), zero));
+    }
+    auto half = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+    half = _mm_add_epi64(half, _mm_unpackhi_epi64(half, half));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(half));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline uint32_t sum_avx512(const char *block, unsigned char bias)
+{
+    auto flip = _mm512_set1_epi8(static_cast<char>(bias));
+    auto zero = _mm512_setzero_si512();
+    auto total = _mm512_setzero_si512();
+    for (size_t i = 0; i < BLOCK_SIZE; i += 64)
+    {
+        auto bytes = _mm512_loadu_si512(block + i);
+        total = _mm512_add_epi64(total, _mm512_sad_epu8(_mm512_xor_si512(bytes, flip), zero));
+    }
+    return static_cast<uint32_t>(_mm512_reduce_add_epi64(total));
+}
+
+#endif
+
+/**
+ * @return The fastest kernel supported by the CPU.
+ */
+inline Kernel select_kernel()
+{
+#ifdef TARPP_CHECKSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) return sum_avx512;
+    if (__builtin_cpu_supports("avx2")) return sum_avx2;
+    if (__builtin_cpu_supports("sse2")) return sum_sse2;
+#endif
+    return sum_portable;
+}
+
+inline uint32_t sum(const char *block, unsigned char bias)
+{
+    static const Kernel kernel = select_kernel();
+    return kernel(block, bias);
+}
+
+} // checksum
+
+/**
+ * Sum of the bytes of a header block taken as unsigned, as specified by ustar.
+ */
+inline uint32_t unsigned_checksum(const char *block)
+{
+    return checksum::sum(block, 0);
+}
+
+/**
+ * Sum of the bytes of a header block taken as signed.
+ */
+inline int32_t signed_checksum(const char *block)
+{
+    return static_cast<int32_t>(checksum::sum(block, 0x80)) - 128 * static_cast<int32_t>(checksum::BLOCK_SIZE);
+}
+
+}} // tarpp::details
+
+#endif //TAR_CHECKSUM_H
@@ -0,0 +1,193 @@
+#pragma once
+
+#ifndef TAR_CONCURRENT_H
+#define TAR_CONCURRENT_H
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "io.h"
+#include "tar.h"
+
+namespace tarpp {
+
+/**
+ * Tar archive writer which any number of threads can add entries to at the same time.
+ *
+ * Every add atomically reserves the part of the archive its entry occupies (header, content and padding, known from
+ * the size) and writes it with pwrite, or copy_file_range for files, on a shared file descriptor: no lock is held
+ * while content is written. The order of entries is the order of reservations.
+ * The file descriptor must be seekable; the archive starts at its current position and the descriptor is not
+ * closed. finalize() must only be called once every add has returned.
+ */
+class ConcurrentTar
+{
+public:
+    explicit ConcurrentTar(int fd, size_t blocking_factor = details::DEFAULT_BLOCKING_FACTOR()) :
+        fd_{fd},
+        start_{::lseek(fd, 0, SEEK_CUR)},
+        record_size_{details::record_size(blocking_factor)},
+        offset_{0},
+        open_{true}
+    {
+        if (start_ < 0)
+        {
+            io::details::throw_errno("tarpp: archive file descriptor is not seekable");
+        }
+    }
+
+    ConcurrentTar(const ConcurrentTar &) = delete;
+    ConcurrentTar &operator=(const ConcurrentTar &) = delete;
+
+    ~ConcurrentTar()
+    {
+        try
+        {
+            finalize();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    void add(const std::string &tar_name, const std::string &content, const TarFileOptions &options = TarFileOptions{})
+    {
+        using namespace details::constants;
+
+        auto header = details::TarHeader{};
+        details::format_header(header, tar_name, content.size(), options);
+        auto offset = reserve(content.size());
+
+        static const char zeros[BLOCK_SIZE] = {};
+        iovec iov[] = {
+            {header.data_, HEADER_SIZE},
+            {const_cast<char *>(content.data()), content.size()},
+            {const_cast<char *>(zeros), details::padding_size(content.size())}
+        };
+        io::pwritev_all(fd_, iov, 3, offset);
+    }
+
+    /**
+     * Add an entry whose content is size bytes read from the current position of fd, copied by the kernel when
+     * possible. If fd does not provide size bytes, the entry is completed with zeros and std::runtime_error is thrown.
+     */
+    void add(const std::string &tar_name, int fd, size_t size, const TarFileOptions &options = TarFileOptions{})
+    {
+        using namespace details::constants;
+
+        auto header = details::TarHeader{};
+        details::format_header(header, tar_name, size, options);
+        auto offset = reserve(size);
+
+        io::pwrite_all(fd_, header.data_, HEADER_SIZE, offset);
+        offset += HEADER_SIZE;
+        auto written = io::copy_at(fd, fd_, offset, size);
+        write_zeros(offset + static_cast<off_t>(written), size - written + details::padding_size(size));
+        if (written < size)
+        {
+            throw std::runtime_error("tarpp: entry content is shorter than its declared size");
+        }
+    }
+
+    /**
+     * Add the regular file at path, as BasicTar::add_file does.
+     */
+    void add_file(const std::string &path, const std::string &tar_name, const TarFileOptions &options = TarFileOptions{})
+    {
+        auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            io::details::throw_errno("tarpp: cannot open file");
+        }
+
+        struct stat status;
+        if (::fstat(fd, &status) != 0)
+        {
+            auto error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "tarpp: cannot stat file");
+        }
+
+        try
+        {
+            add(tar_name, fd, static_cast<size_t>(status.st_size), options);
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+    }
+
+    /**
+     * Size of the archive reserved so far.
+     */
+    size_t offset() const { return offset_.load(); }
+
+    /**
+     * Write the end-of-archive blocks and the padding to a whole record after the last reserved entry. The archive
+     * file position is left at the end of the archive.
+     */
+    void finalize()
+    {
+        using namespace details::constants;
+        if (!open_) return;
+
+        open_ = false;
+        auto end = offset_.load() + 2 * BLOCK_SIZE;
+        end += (record_size_ - end % record_size_) % record_size_;
+        write_zeros(start_ + static_cast<off_t>(offset_.load()), end - offset_.load());
+        if (::lseek(fd_, start_ + static_cast<off_t>(end), SEEK_SET) < 0)
+        {
+            io::details::throw_errno("tarpp: cannot seek archive file");
+        }
+    }
+
+private:
+    /**
+     * Reserve the part of the archive taken by an entry with size bytes of content.
+     * @return The absolute file offset of the entry.
+     */
+    off_t reserve(size_t size)
+    {
+        using namespace details::constants;
+
+        if (!open_)
+        {
+            throw std::logic_error("tarpp: cannot add an entry to a finalized archive");
+        }
+        auto length = HEADER_SIZE + size + details::padding_size(size);
+        return start_ + static_cast<off_t>(offset_.fetch_add(length));
+    }
+
+    void write_zeros(off_t offset, size_t size)
+    {
+        using namespace details::constants;
+
+        static const char zeros[STREAM_CHUNK_SIZE] = {};
+        while (size > 0)
+        {
+            auto length = std::min(size, sizeof(zeros));
+            io::pwrite_all(fd_, zeros, length, offset);
+            offset += static_cast<off_t>(length);
+            size -= length;
+        }
+    }
+
+    int fd_;
+    off_t start_;
+    size_t record_size_;
+    std::atomic<size_t> offset_;
+    std::atomic<bool> open_;
+};
+
+} // tarpp
+
+#endif //TAR_CONCURRENT_H
@@ -0,0 +1,136 @@
+#pragma once
+
+#ifndef TAR_DEDUP_H
+#define TAR_DEDUP_H
+
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+namespace tarpp {
+namespace details {
+
+/**
+ * Fast non-cryptographic 64-bit hash of a buffer, reading it a word at a time. Equal hashes must be confirmed by
+ * comparing the content.
+ */
+inline uint64_t hash_content(const char *data, size_t size)
+{
+    const uint64_t multiplier = 0x9e3779b97f4a7c15ULL;
+
+    auto mix = [](uint64_t hash) {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        hash ^= hash >> 33;
+        return hash;
+    };
+
+    auto hash = static_cast<uint64_t>(size) * multiplier;
+    while (size >= sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        hash = (hash ^ mix(word)) * multiplier;
+        hash = (hash << 31) | (hash >> 33);
+        data += sizeof(word);
+        size -= sizeof(word);
+    }
+
+    uint64_t tail = 0;
+    std::memcpy(&tail, data, size);
+    return mix(hash ^ tail);
+}
+
+/**
+ * Index of the content of the entries already archived, to find identical ones. The content is kept to confirm
+ * matches, up to capacity bytes: the oldest entries are forgotten first when it is exceeded.
+ * Entries also match on their attributes (compared with ==), those a link to them could not record.
+ */
+template<typename Attributes>
+class ContentIndex
+{
+public:
+    explicit ContentIndex(size_t capacity = 0) :
+        capacity_{capacity},
+        size_{0}
+    {}
+
+    size_t capacity() const { return capacity_; }
+
+    void set_capacity(size_t capacity)
+    {
+        capacity_ = capacity;
+        evict(0);
+    }
+
+    /**
+     * @return The name of an indexed entry with the given content and attributes, nullptr if there is none.
+     */
+    const std::string *find(const std::string &content, const Attributes &attributes) const
+    {
+        auto range = by_hash_.equal_range(hash_content(content.data(), content.size()));
+        for (auto position = range.first; position != range.second; ++position)
+        {
+            if (position->second->content == content && position->second->attributes == attributes)
+            {
+                return &position->second->name;
+            }
+        }
+        return nullptr;
+    }
+
+    void add(const std::string &name, const std::string &content, const Attributes &attributes)
+    {
+        if (content.size() > capacity_) return;
+
+        evict(content.size());
+        auto hash = hash_content(content.data(), content.size());
+        entries_.push_back(Entry{hash, name, content, attributes});
+        by_hash_.emplace(hash, std::prev(entries_.end()));
+        size_ += content.size();
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t hash;
+        std::string name;
+        std::string content;
+        Attributes attributes;
+    };
+
+    /**
+     * Forget the oldest entries until size more bytes fit.
+     */
+    void evict(size_t size)
+    {
+        while (!entries_.empty() && size_ + size > capacity_)
+        {
+            auto oldest = entries_.begin();
+            auto range = by_hash_.equal_range(oldest->hash);
+            for (auto position = range.first; position != range.second; ++position)
+            {
+                if (position->second == oldest)
+                {
+                    by_hash_.erase(position);
+                    break;
+                }
+            }
+            size_ -= oldest->content.size();
+            entries_.pop_front();
+        }
+    }
+
+    size_t capacity_;
+    size_t size_;
+    std::list<Entry> entries_;
+    std::unordered_multimap<uint64_t, typename std::list<Entry>::iterator> by_hash_;
+};
+
+}} // tarpp::details
+
+#endif //TAR_DEDUP_H
@@ -0,0 +1,538 @@
+#pragma once
+
+#ifndef TAR_DIRECTORY_H
+#define TAR_DIRECTORY_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+#include "io.h"
+#include "scheduler.h"
+#include "tar.h"
+#include "user.h"
+
+namespace tarpp {
+namespace details {
+namespace constants {
+
+enum
+{
+    // Number of entries being loaded ahead of the one written
+    DIRECTORY_WINDOW = 256,
+
+    // Files up to this size are read by the workers, larger ones are copied by the writing thread
+    SMALL_FILE_SIZE = 1024 * 1024,
+
+    // Size of the chunks large files are read in
+    FILE_CHUNK_SIZE = 1024 * 1024,
+
+    // Maximum amount of content held by the reorder buffer
+    REORDER_BUFFER_SIZE = 64 * 1024 * 1024
+};
+
+} // constants
+
+/**
+ * An entry of the walked tree, identified by its position in the archive.
+ */
+struct DirectoryJob
+{
+    size_t index;
+    std::string path;
+    std::string tar_name;
+};
+
+/**
+ * A file descriptor shared by the tasks reading a file, closed with the last of them.
+ */
+struct OpenFile
+{
+    explicit OpenFile(int fd) : fd{fd} {}
+
+    OpenFile(const OpenFile &) = delete;
+    OpenFile &operator=(const OpenFile &) = delete;
+
+    ~OpenFile()
+    {
+        ::close(fd);
+    }
+
+    int fd;
+};
+
+/**
+ * What a worker learnt about an entry: its status and, for symbolic links and small files, its content. Other
+ * regular files are handed over open, and possibly read in chunk_count chunks by other tasks.
+ */
+struct DirectoryResult
+{
+    DirectoryResult() :
+        status{},
+        chunk_count{0}
+    {}
+
+    std::string tar_name;
+    struct stat status;
+    std::string content;
+    std::shared_ptr<OpenFile> file;
+    size_t chunk_count;
+    std::exception_ptr error;
+};
+
+/**
+ * A chunk of a large file, which is not loaded when the reorder buffer was full.
+ */
+struct DirectoryChunk
+{
+    std::string content;
+    bool loaded;
+    std::exception_ptr error;
+};
+
+/**
+ * Depth-first walk of a directory tree, entries of a directory being sorted by name so that the order of the
+ * archive does not depend on the file system. Directories come before their content.
+ */
+class DirectoryWalker
+{
+public:
+    explicit DirectoryWalker(const std::string &root)
+    {
+        enter(root, "");
+    }
+
+    /**
+     * Get the next entry of the tree.
+     * @return false once the whole tree has been walked.
+     */
+    bool next(std::string &path, std::string &tar_name)
+    {
+        while (!stack_.empty())
+        {
+            auto &directory = stack_.back();
+            if (directory.next == directory.entries.size())
+            {
+                stack_.pop_back();
+                continue;
+            }
+
+            const auto &entry = directory.entries[directory.next++];
+            path = directory.path + "/" + entry.first;
+            tar_name = directory.tar_prefix + entry.first;
+            if (entry.second)
+            {
+                tar_name += "/";
+                enter(path, tar_name);
+            }
+            return true;
+        }
+        return false;
+    }
+
+private:
+    struct Directory
+    {
+        std::string path;
+        std::string tar_prefix;
+        std::vector<std::pair<std::string, bool>> entries;  // Name, and whether it is a directory
+        size_t next;
+    };
+
+    void enter(const std::string &path, const std::string &tar_prefix)
+    {
+        auto directory = Directory{path, tar_prefix, {}, 0};
+
+        auto handle = ::opendir(path.c_str());
+        if (!handle)
+        {
+            io::details::throw_errno("tarpp: cannot open directory");
+        }
+        while (auto entry = ::readdir(handle))
+        {
+            auto name = std::string{entry->d_name};
+            if (name == "." || name == "..") continue;
+
+            auto is_directory = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN)
+            {
+                struct stat status;
+                is_directory = ::lstat((path + "/" + name).c_str(), &status) == 0 && S_ISDIR(status.st_mode);
+            }
+            directory.entries.emplace_back(std::move(name), is_directory);
+        }
+        ::closedir(handle);
+
+        std::sort(directory.entries.begin(), directory.entries.end());
+        stack_.push_back(std::move(directory));
+    }
+
+    std::vector<Directory> stack_;
+};
+
+/**
+ * Pool of threads stating, opening and reading the entries of a tree ahead of the thread writing the archive.
+ * Results are kept in a reorder buffer until they are taken, in order, by the writing thread. File content held by
+ * the buffer is bounded by memory_budget: files which do not fit are handed over open instead.
+ * When split_large_files is set, files larger than SMALL_FILE_SIZE are read in FILE_CHUNK_SIZE chunks by separate
+ * tasks, which idle threads steal, instead of being left to the writing thread.
+ */
+class DirectoryReaderPool
+{
+public:
+    DirectoryReaderPool(size_t thread_count, size_t memory_budget, bool split_large_files) :
+        memory_budget_{memory_budget},
+        memory_used_{0},
+        split_large_files_{split_large_files},
+        scheduler_{thread_count}
+    {}
+
+    DirectoryReaderPool(const DirectoryReaderPool &) = delete;
+    DirectoryReaderPool &operator=(const DirectoryReaderPool &) = delete;
+
+    void push(DirectoryJob job)
+    {
+        auto shared_job = std::make_shared<DirectoryJob>(std::move(job));
+        scheduler_.submit([this, shared_job] { load_entry(*shared_job); });
+    }
+
+    /**
+     * Wait for the result of the job with the given index and take it out of the reorder buffer.
+     */
+    DirectoryResult pop(size_t index)
+    {
+        std::unique_lock<std::mutex> lock{mutex_};
+        auto position = results_.end();
+        result_ready_.wait(lock, [&] { return (position = results_.find(index)) != results_.end(); });
+
+        auto result = std::move(position->second);
+        results_.erase(position);
+        if (S_ISREG(result.status.st_mode))
+        {
+            memory_used_ -= result.content.size();
+        }
+        return result;
+    }
+
+    /**
+     * Wait for a chunk of the file of the job with the given index and take it out of the reorder buffer.
+     */
+    DirectoryChunk pop_chunk(size_t index, size_t chunk)
+    {
+        std::unique_lock<std::mutex> lock{mutex_};
+        auto position = chunks_.end();
+        result_ready_.wait(lock, [&] {
+            return (position = chunks_.find(std::make_pair(index, chunk))) != chunks_.end();
+        });
+
+        auto result = std::move(position->second);
+        chunks_.erase(position);
+        memory_used_ -= result.content.size();
+        return result;
+    }
+
+private:
+    void load_entry(const DirectoryJob &job)
+    {
+        auto result = DirectoryResult{};
+        result.tar_name = job.tar_name;
+        try
+        {
+            load(job, result);
+        }
+        catch (...)
+        {
+            result.error = std::current_exception();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            results_.emplace(job.index, std::move(result));
+        }
+        result_ready_.notify_all();
+    }
+
+    void load(const DirectoryJob &job, DirectoryResult &result)
+    {
+        using namespace constants;
+
+        const auto &path = job.path;
+        if (::lstat(path.c_str(), &result.status) != 0)
+        {
+            io::details::throw_errno("tarpp: cannot stat file");
+        }
+
+        if (S_ISLNK(result.status.st_mode))
+        {
+            result.content.resize(static_cast<size_t>(result.status.st_size) + 1);
+            auto length = ::readlink(path.c_str(), &result.content[0], result.content.size());
+            if (length < 0)
+            {
+                io::details::throw_errno("tarpp: cannot read symbolic link");
+            }
+            result.content.resize(static_cast<size_t>(length));
+            return;
+        }
+        if (!S_ISREG(result.status.st_mode)) return;
+
+        auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            io::details::throw_errno("tarpp: cannot open file");
+        }
+        result.file = std::make_shared<OpenFile>(fd);
+
+        auto size = static_cast<size_t>(result.status.st_size);
+        if (result.status.st_nlink > 1)
+        {
+            // Only read by the writing thread if it is the first link to the file
+            return;
+        }
+        if (size > SMALL_FILE_SIZE)
+        {
+            if (split_large_files_)
+            {
+                result.chunk_count = (size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE;
+                for (size_t chunk = 0; chunk < result.chunk_count; ++chunk)
+                {
+                    auto file = result.file;
+                    auto index = job.index;
+                    auto offset = chunk * FILE_CHUNK_SIZE;
+                    auto length = std::min(size - offset, (size_t)FILE_CHUNK_SIZE);
+                    scheduler_.submit([this, file, index, chunk, offset, length] {
+                        load_chunk(*file, index, chunk, offset, length);
+                    });
+                }
+            }
+            return;
+        }
+        if (!reserve(size)) return;
+
+        result.content.resize(size);
+        auto read = io::read_at(fd, &result.content[0], size, 0);
+        release(size - read);
+        result.content.resize(read);
+        result.file.reset();
+    }
+
+    void load_chunk(const OpenFile &file, size_t index, size_t chunk, size_t offset, size_t length)
+    {
+        auto result = DirectoryChunk{"", false, nullptr};
+        if (reserve(length))
+        {
+            try
+            {
+                result.content.resize(length);
+                auto read = io::read_at(file.fd, &result.content[0], length, static_cast<off_t>(offset));
+                result.content.resize(read);
+                result.loaded = true;
+            }
+            catch (...)
+            {
+                result.content.clear();
+                result.error = std::current_exception();
+            }
+            release(length - result.content.size());
+        }
+
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            chunks_.emplace(std::make_pair(index, chunk), std::move(result));
+        }
+        result_ready_.notify_all();
+    }
+
+    bool reserve(size_t size)
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        if (memory_used_ + size > memory_budget_) return false;
+        memory_used_ += size;
+        return true;
+    }
+
+    void release(size_t size)
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        memory_used_ -= size;
+    }
+
+    size_t memory_budget_;
+    size_t memory_used_;
+    bool split_large_files_;
+    std::mutex mutex_;
+    std::condition_variable result_ready_;
+    std::map<size_t, DirectoryResult> results_;
+    std::map<std::pair<size_t, size_t>, DirectoryChunk> chunks_;
+    WorkStealingScheduler scheduler_;   // Last, so that its threads are stopped first
+};
+
+/**
+ * User and group names, looked up once per id.
+ */
+class NameCache
+{
+public:
+    const std::string &user(uid_t uid)
+    {
+        auto position = users_.find(uid);
+        if (position == users_.end())
+        {
+            position = users_.emplace(uid, user::get_user_name(uid)).first;
+        }
+        return position->second;
+    }
+
+    const std::string &group(gid_t gid)
+    {
+        auto position = groups_.find(gid);
+        if (position == groups_.end())
+        {
+            position = groups_.emplace(gid, user::get_group_name(gid)).first;
+        }
+        return position->second;
+    }
+
+private:
+    std::map<uid_t, std::string> users_;
+    std::map<gid_t, std::string> groups_;
+};
+
+template<typename Sink, typename Format>
+void add_directory_entry(BasicTar<Sink, Format> &tar, DirectoryReaderPool &pool, size_t index, NameCache &names,
+                         HardLinks &links)
+{
+    auto result = pool.pop(index);
+    if (result.error)
+    {
+        std::rethrow_exception(result.error);
+    }
+
+    const auto &status = result.status;
+    auto type = FileType::REGULAR;
+    if (S_ISDIR(status.st_mode)) type = FileType::DIRECTORY;
+    else if (S_ISLNK(status.st_mode)) type = FileType::SIMLINK;
+    else if (S_ISCHR(status.st_mode)) type = FileType::CHARACTER_SPECIAL_DEVICE;
+    else if (S_ISBLK(status.st_mode)) type = FileType::BLOCK_SPECIAL_DEVICE;
+    else if (S_ISFIFO(status.st_mode)) type = FileType::FIFO_SPECIAL_FILE;
+    else if (!S_ISREG(status.st_mode)) return;  // Sockets cannot be archived
+
+    auto options = TarFileOptions{
+        static_cast<mode_t>(status.st_mode & 07777),
+        status.st_uid,
+        status.st_gid,
+        status.st_mtime,
+        type,
+        type == FileType::SIMLINK ? result.content : "",
+        names.user(status.st_uid),
+        names.group(status.st_gid),
+        is_device(type) ? major(status.st_rdev) : 0,
+        is_device(type) ? minor(status.st_rdev) : 0
+    };
+
+    if (auto target = links.find(status))
+    {
+        tar.add(result.tar_name, "", options.with_type(FileType::LINK).with_linkname(*target));
+        return;
+    }
+
+    if (result.chunk_count > 0)
+    {
+        auto entry = tar.begin_entry(result.tar_name, static_cast<size_t>(status.st_size), options);
+        for (size_t chunk = 0; chunk < result.chunk_count; ++chunk)
+        {
+            auto loaded = pool.pop_chunk(index, chunk);
+            if (loaded.error)
+            {
+                std::rethrow_exception(loaded.error);
+            }
+            if (!loaded.loaded)
+            {
+                auto offset = chunk * constants::FILE_CHUNK_SIZE;
+                loaded.content.resize(std::min(static_cast<size_t>(status.st_size) - offset, (size_t)constants::FILE_CHUNK_SIZE));
+                loaded.content.resize(io::read_at(result.file->fd, &loaded.content[0], loaded.content.size(),
+                                                  static_cast<off_t>(offset)));
+            }
+            entry.write(loaded.content);
+        }
+        entry.close();
+    }
+    else if (result.file)
+    {
+        tar.add_file(result.file->fd, result.tar_name, static_cast<size_t>(status.st_size), options);
+    }
+    else if (type == FileType::REGULAR)
+    {
+        tar.add(result.tar_name, result.content, options);
+    }
+    else
+    {
+        tar.add(result.tar_name, "", options);
+    }
+    links.record(status, result.tar_name);
+}
+
+} // details
+
+/**
+ * Add every entry of the tree under root to tar, named relatively to root, in a deterministic order (see
+ * details::DirectoryWalker). Entries are stated, opened and read by thread_count threads (the number of cores if
+ * 0) ahead of the calling thread, which writes them in order. Large files are read in parallel chunks unless the
+ * sink can have them copied by the kernel. Files with several hard links are archived once, further links being
+ * added as FileType::LINK entries. Device nodes are archived with their device numbers, sockets are skipped.
+ */
+template<typename Sink, typename Format>
+void archive_directory(const std::string &root, BasicTar<Sink, Format> &tar, size_t thread_count = 0)
+{
+    using namespace details::constants;
+
+    if (thread_count == 0)
+    {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    details::DirectoryWalker walker{root};
+    details::DirectoryReaderPool pool{thread_count, REORDER_BUFFER_SIZE, !details::can_copy_files<Sink>::value};
+    details::NameCache names;
+    details::HardLinks links{Format::max_linkname_size()};
+
+    size_t pushed = 0;
+    size_t written = 0;
+    auto more = true;
+    while (more || written < pushed)
+    {
+        while (more && pushed - written < DIRECTORY_WINDOW)
+        {
+            auto job = details::DirectoryJob{pushed, "", ""};
+            more = walker.next(job.path, job.tar_name);
+            if (more)
+            {
+                pool.push(std::move(job));
+                ++pushed;
+            }
+        }
+
+        if (written < pushed)
+        {
+            details::add_directory_entry(tar, pool, written++, names, links);
+        }
+    }
+}
+
+} // tarpp
+
+#endif //TAR_DIRECTORY_H
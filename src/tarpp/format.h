@@ -3,60 +3,70 @@
 #ifndef TAR_FORMAT_H
 #define TAR_FORMAT_H
 
-#include <cstdio>
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
+#include <string>
+#include <type_traits>
 
 namespace tarpp {
 namespace format {
 
 namespace details {
 
-template<size_t N>
-struct last_digit_char
-{
-    enum
-    {
-        value = static_cast<char>('0' + N % 10)
-    };
-};
-
 /**
- * A type containing a char array filled with the values of its template arguments.
+ * Number of octal digits needed to write value.
  */
-template<char... cs>
-struct octal_format_string_holder
+template<typename T>
+constexpr size_t octal_digits(T value)
 {
-    static constexpr const char value[sizeof...(cs)] = {cs...};
-};
-template<char... cs>
-constexpr const char octal_format_string_holder<cs...>::value[sizeof...(cs)];
-
-template<size_t N, template<size_t> class F, char... args>
-struct generate_octal_format_string
-{
-    using type = typename generate_octal_format_string<N / 10, F, F<N>::value, args...>::type;
-};
+    return value < 8 ? 1 : 1 + octal_digits<T>(value >> 3);
+}
 
-template<template<size_t> class F, char... args>
-struct generate_octal_format_string<0, F, args...>
+/**
+ * Pairs of octal digits, indexed by a 6-bit value.
+ */
+template<typename = void>
+struct octal_pairs
 {
-    using type = octal_format_string_holder<'%', '0', args..., 'o', '\0'>;
+    static constexpr const char value[129] =
+        "0001020304050607101112131415161720212223242526273031323334353637"
+        "4041424344454647505152535455565760616263646566677071727374757677";
 };
+template<typename T>
+constexpr const char octal_pairs<T>::value[129];
 
 /**
- * A type containing the null terminated format string required to format a number as
- * a 0 filled octal string for a buffer of size N.
- * e.g.: "%012o" if N = 12.
- * @tparam N The size of the buffer.
+ * Write the WIDTH first characters of value as a '0' filled octal number of at least WIDTH digits, the way
+ * snprintf("%0<WIDTH>o") would, two digits at a time.
+ * @return Number of digits of the whole number.
  */
-template<size_t N>
-struct octal_format_string
+template<size_t WIDTH, typename T>
+int write_octal(char *buffer, T value)
 {
-    typedef typename generate_octal_format_string<N, last_digit_char>::type type;
-};
+    using Unsigned = typename std::make_unsigned<T>::type;
 
-template<size_t N>
-using octal_format_string_t = typename octal_format_string<N>::type;
+    auto number = static_cast<Unsigned>(value);
+    auto digits = std::max(WIDTH, octal_digits(number));
+    if (WIDTH > 0 && digits > WIDTH)
+    {
+        // Drop the digits which do not fit, as they are the last ones.
+        number >>= 3 * (digits - WIDTH);
+    }
+
+    auto position = WIDTH;
+    while (position >= 2)
+    {
+        std::memcpy(buffer + position - 2, octal_pairs<>::value + 2 * (number & 077), 2);
+        number >>= 6;
+        position -= 2;
+    }
+    if (position == 1)
+    {
+        buffer[0] = static_cast<char>('0' + (number & 07));
+    }
+    return static_cast<int>(digits);
+}
 
 }
 
@@ -70,7 +80,9 @@ int format_octal(char (&buffer)[LENGTH], T value)
 {
     static_assert(LENGTH > 0, "Invalid buffer length.");
     static_assert(std::is_integral<T>::value, "Only integral types can be formatted as octal.");
-    return snprintf(buffer, LENGTH, details::octal_format_string_t<LENGTH - 1>::value, value);
+    auto result = details::write_octal<LENGTH - 1>(buffer, value);
+    buffer[LENGTH - 1] = '\0';
+    return result;
 }
 
 /**
@@ -83,10 +95,40 @@ int format_octal_no_null(char (&buffer)[LENGTH], T value)
 {
     static_assert(LENGTH > 0, "Invalid buffer length.");
     static_assert(std::is_integral<T>::value, "Only integral types can be formatted as octal.");
-    char tmp_buffer[LENGTH + 1];
-    auto result = snprintf(tmp_buffer, LENGTH + 1, details::octal_format_string_t<LENGTH>::value, value);
-    std::memcpy(buffer, tmp_buffer, LENGTH);
-    return result;
+    return details::write_octal<LENGTH>(buffer, value);
+}
+
+/**
+ * Print a integral type into the given buffer in GNU's base-256 encoding: a big-endian two's complement number
+ * taking the whole buffer, whose most significant bit is set to mark the encoding.
+ * @return false, leaving the buffer untouched, if the value does not fit.
+ */
+template<typename T, size_t LENGTH>
+bool format_base256(char (&buffer)[LENGTH], T value)
+{
+    static_assert(LENGTH > 0, "Invalid buffer length.");
+    static_assert(std::is_integral<T>::value, "Only integral types can be formatted as base-256.");
+    using Unsigned = typename std::make_unsigned<T>::type;
+
+    auto negative = std::is_signed<T>::value && value < T{};
+    auto number = static_cast<uint64_t>(static_cast<Unsigned>(value));
+    if (negative)
+    {
+        number |= ~uint64_t{0} << (sizeof(T) * 8 - 1);
+    }
+
+    // The bits above the LENGTH * 8 - 1 lowest ones must be copies of the sign bit, the most significant one
+    // holding the marker.
+    const size_t value_bits = LENGTH * 8 - 1;
+    if (value_bits < 64 && ((negative ? ~number : number) >> (value_bits < 64 ? value_bits : 0)) != 0) return false;
+
+    for (auto position = LENGTH; position > 0; --position)
+    {
+        buffer[position - 1] = static_cast<char>(number & 0xff);
+        number = negative ? (number >> 8) | (uint64_t{0xff} << 56) : number >> 8;
+    }
+    buffer[0] = static_cast<char>(buffer[0] | 0x80);
+    return true;
 }
 
 /**
@@ -98,7 +140,11 @@ template<size_t LENGTH>
 int format_string(char (&buffer)[LENGTH], const char *content)
 {
     static_assert(LENGTH > 0, "Invalid buffer length.");
-    return snprintf(buffer, LENGTH, "%s", content);
+    auto length = std::strlen(content);
+    auto copied = std::min(length, LENGTH - 1);
+    std::memcpy(buffer, content, copied);
+    buffer[copied] = '\0';
+    return static_cast<int>(length);
 }
 
 template<size_t LENGTH>
@@ -0,0 +1,373 @@
+#pragma once
+
+#ifndef TAR_IO_H
+#define TAR_IO_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+namespace tarpp {
+namespace io {
+
+namespace details {
+
+enum
+{
+    COPY_BUFFER_SIZE = 64 * 1024
+};
+
+[[noreturn]] inline void throw_errno(const char *what)
+{
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+/**
+ * Errors returned by copy_file_range/sendfile meaning the kernel cannot copy between these descriptors, in which
+ * case the next, slower, strategy is tried.
+ */
+inline bool is_unsupported_copy(int error)
+{
+    return error == EINVAL || error == EXDEV || error == ENOSYS || error == EOPNOTSUPP || error == EBADF;
+}
+
+} // details
+
+/**
+ * Read up to length bytes from fd, retrying on interruption.
+ * @return Number of bytes read, 0 at end of file.
+ */
+inline size_t read_some(int fd, char *buffer, size_t length)
+{
+    ssize_t result;
+    do
+    {
+        result = ::read(fd, buffer, length);
+    } while (result < 0 && errno == EINTR);
+    if (result < 0)
+    {
+        details::throw_errno("tarpp: cannot read from file descriptor");
+    }
+    return static_cast<size_t>(result);
+}
+
+/**
+ * Read length bytes from fd at offset, retrying on interruption and short reads.
+ * @return Number of bytes read, smaller than length only at end of file.
+ */
+inline size_t read_at(int fd, char *buffer, size_t length, off_t offset)
+{
+    auto read = size_t{0};
+    while (read < length)
+    {
+        auto result = ::pread(fd, buffer + read, length - read, offset + static_cast<off_t>(read));
+        if (result < 0)
+        {
+            if (errno == EINTR) continue;
+            details::throw_errno("tarpp: cannot read from file descriptor");
+        }
+        if (result == 0) break;
+        read += static_cast<size_t>(result);
+    }
+    return read;
+}
+
+/**
+ * Write all length bytes to fd, retrying on interruption and short writes.
+ */
+inline void write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        auto result = ::write(fd, data, length);
+        if (result < 0)
+        {
+            if (errno == EINTR) continue;
+            details::throw_errno("tarpp: cannot write to file descriptor");
+        }
+        data += result;
+        length -= static_cast<size_t>(result);
+    }
+}
+
+/**
+ * Write all length bytes to fd at offset, retrying on interruption and short writes.
+ */
+inline void pwrite_all(int fd, const char *data, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        auto result = ::pwrite(fd, data, length, offset);
+        if (result < 0)
+        {
+            if (errno == EINTR) continue;
+            details::throw_errno("tarpp: cannot write to file descriptor");
+        }
+        data += result;
+        length -= static_cast<size_t>(result);
+        offset += result;
+    }
+}
+
+/**
+ * Write all the buffers described by iov to fd, with as few writev calls as the IOV_MAX limit and short writes
+ * allow. The iovec array is modified to keep track of partial writes.
+ */
+inline void writev_all(int fd, iovec *iov, size_t count)
+{
+    while (count > 0 && iov->iov_len == 0)
+    {
+        ++iov;
+        --count;
+    }
+    while (count > 0)
+    {
+        auto result = ::writev(fd, iov, static_cast<int>(std::min(count, (size_t)IOV_MAX)));
+        if (result < 0)
+        {
+            if (errno == EINTR) continue;
+            details::throw_errno("tarpp: cannot write to file descriptor");
+        }
+
+        auto written = static_cast<size_t>(result);
+        while (count > 0 && written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+/**
+ * Write all the buffers described by iov to fd at offset, as writev_all does.
+ */
+inline void pwritev_all(int fd, iovec *iov, size_t count, off_t offset)
+{
+    while (count > 0 && iov->iov_len == 0)
+    {
+        ++iov;
+        --count;
+    }
+    while (count > 0)
+    {
+        auto result = ::pwritev(fd, iov, static_cast<int>(std::min(count, (size_t)IOV_MAX)), offset);
+        if (result < 0)
+        {
+            if (errno == EINTR) continue;
+            details::throw_errno("tarpp: cannot write to file descriptor");
+        }
+
+        offset += result;
+        auto written = static_cast<size_t>(result);
+        while (count > 0 && written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+/**
+ * Create an anonymous temporary file in $TMPDIR (or /tmp), which disappears when closed.
+ * @return The file descriptor of the file.
+ */
+inline int make_temp_file()
+{
+    auto directory = std::getenv("TMPDIR");
+    if (!directory || !*directory)
+    {
+        directory = const_cast<char *>("/tmp");
+    }
+
+#ifdef O_TMPFILE
+    auto fd = ::open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) return fd;
+#endif
+
+    auto path = std::string{directory} + "/tarpp-XXXXXX";
+    auto temp_fd = ::mkostemp(&path[0], O_CLOEXEC);
+    if (temp_fd < 0)
+    {
+        details::throw_errno("tarpp: cannot create temporary file");
+    }
+    ::unlink(path.c_str());
+    return temp_fd;
+}
+
+/**
+ * A range of a file holding data.
+ */
+struct DataSegment
+{
+    off_t offset;
+    size_t size;
+};
+
+/**
+ * Find the data segments of the first size bytes of a file, skipping holes, with lseek(SEEK_DATA/SEEK_HOLE). When
+ * the system or the file system cannot report holes, the whole file is a single segment. The file position of fd is
+ * left undefined.
+ */
+inline std::vector<DataSegment> data_segments(int fd, size_t size)
+{
+    auto segments = std::vector<DataSegment>{};
+    auto end = static_cast<off_t>(size);
+
+#ifdef SEEK_DATA
+    auto offset = off_t{0};
+    while (offset < end)
+    {
+        auto data = ::lseek(fd, offset, SEEK_DATA);
+        if (data < 0)
+        {
+            if (errno == ENXIO) break;  // Only a hole until the end of the file
+            if (errno == EINVAL && offset == 0)
+            {
+                return {DataSegment{0, size}};
+            }
+            details::throw_errno("tarpp: cannot find data in file");
+        }
+        if (data >= end) break;
+
+        auto hole = ::lseek(fd, data, SEEK_HOLE);
+        if (hole < 0)
+        {
+            details::throw_errno("tarpp: cannot find holes in file");
+        }
+        hole = std::min(hole, end);
+        segments.push_back(DataSegment{data, static_cast<size_t>(hole - data)});
+        offset = hole;
+    }
+#else
+    if (size > 0)
+    {
+        segments.push_back(DataSegment{0, size});
+    }
+#endif
+
+    return segments;
+}
+
+/**
+ * Copy size bytes from the current position of in to the current position of out.
+ * The copy is done in the kernel with copy_file_range, or sendfile when the descriptors do not support it, and
+ * falls back to a buffered read/write loop otherwise.
+ * @return Number of bytes copied, smaller than size only if in reached end of file.
+ */
+inline size_t copy(int in, int out, size_t size)
+{
+    auto remaining = size;
+
+#ifdef __linux__
+    auto use_copy_file_range = true;
+    while (remaining > 0)
+    {
+        ssize_t result;
+        if (use_copy_file_range)
+        {
+            result = ::copy_file_range(in, nullptr, out, nullptr, remaining, 0);
+        }
+        else
+        {
+            result = ::sendfile(out, in, nullptr, remaining);
+        }
+
+        if (result < 0)
+        {
+            if (errno == EINTR) continue;
+            if (!details::is_unsupported_copy(errno))
+            {
+                details::throw_errno("tarpp: cannot copy between file descriptors");
+            }
+            if (use_copy_file_range)
+            {
+                use_copy_file_range = false;
+                continue;
+            }
+            break;
+        }
+        if (result == 0) return size - remaining;
+        remaining -= static_cast<size_t>(result);
+    }
+#endif
+
+    auto buffer = std::vector<char>(std::min(remaining, (size_t)details::COPY_BUFFER_SIZE));
+    while (remaining > 0)
+    {
+        auto read = read_some(in, buffer.data(), std::min(remaining, buffer.size()));
+        if (read == 0) break;
+        write_all(out, buffer.data(), read);
+        remaining -= read;
+    }
+    return size - remaining;
+}
+
+/**
+ * Copy size bytes from the current position of in to out at offset, without using or moving the position of out.
+ * The copy is done in the kernel with copy_file_range when the descriptors support it, and falls back to a buffered
+ * read/pwrite loop otherwise.
+ * @return Number of bytes copied, smaller than size only if in reached end of file.
+ */
+inline size_t copy_at(int in, int out, off_t offset, size_t size)
+{
+    auto remaining = size;
+
+#ifdef __linux__
+    while (remaining > 0)
+    {
+        auto out_offset = static_cast<loff_t>(offset);
+        auto result = ::copy_file_range(in, nullptr, out, &out_offset, remaining, 0);
+        if (result < 0)
+        {
+            if (errno == EINTR) continue;
+            if (!details::is_unsupported_copy(errno))
+            {
+                details::throw_errno("tarpp: cannot copy between file descriptors");
+            }
+            break;
+        }
+        if (result == 0) return size - remaining;
+        offset += result;
+        remaining -= static_cast<size_t>(result);
+    }
+#endif
+
+    auto buffer = std::vector<char>(std::min(remaining, (size_t)details::COPY_BUFFER_SIZE));
+    while (remaining > 0)
+    {
+        auto read = read_some(in, buffer.data(), std::min(remaining, buffer.size()));
+        if (read == 0) break;
+        pwrite_all(out, buffer.data(), read, offset);
+        offset += static_cast<off_t>(read);
+        remaining -= read;
+    }
+    return size - remaining;
+}
+
+}} // tarpp::io
+
+#endif //TAR_IO_H
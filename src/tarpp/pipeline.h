@@ -0,0 +1,264 @@
+#pragma once
+
+#ifndef TAR_PIPELINE_H
+#define TAR_PIPELINE_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "sink.h"
+#include "tar.h"
+
+namespace tarpp {
+namespace sink {
+
+/**
+ * Sink handing writes over to a dedicated I/O thread, which writes them to another sink.
+ *
+ * Writes are copied into a single-producer/single-consumer ring of 512-byte-aligned blocks, synchronized with
+ * atomics only; a thread only sleeps when the ring is full (producer) or empty (I/O thread). This hides the latency
+ * of the wrapped sink from the thread formatting the archive. Errors of the wrapped sink are reported by the next
+ * write or by finish(), which waits for every write to complete.
+ */
+template<typename Sink>
+class PipelinedSink
+{
+public:
+    enum
+    {
+        SLOT_SIZE = 512,
+        CACHE_LINE_SIZE = 64,
+        DEFAULT_RING_SIZE = 1024 * 1024
+    };
+
+    explicit PipelinedSink(Sink sink, size_t ring_size = DEFAULT_RING_SIZE) :
+        state_{new State{std::move(sink), ring_size}}
+    {
+        auto state = state_.get();
+        state_->thread = std::thread{[state] { state->drain(); }};
+    }
+
+    PipelinedSink(PipelinedSink &&) = default;
+
+    ~PipelinedSink()
+    {
+        if (state_)
+        {
+            try
+            {
+                stop();
+            }
+            catch (...)
+            {
+            }
+        }
+    }
+
+    void write(const char *data, size_t size)
+    {
+        state_->check_error();
+        state_->write(data, size);
+    }
+
+    /**
+     * Wait for the I/O thread to write everything, then finish the wrapped sink.
+     */
+    void finish()
+    {
+        stop();
+        finish_sink(details::has_finish<Sink>{});
+    }
+
+    /**
+     * The wrapped sink, which must only be used once the sink is finished.
+     */
+    Sink &sink() { return state_->sink; }
+
+private:
+    struct FreeDeleter
+    {
+        void operator()(char *data) const { std::free(data); }
+    };
+
+    struct State
+    {
+        State(Sink sink, size_t ring_size) :
+            sink(std::move(sink)),
+            capacity{std::max((ring_size + SLOT_SIZE - 1) / SLOT_SIZE, (size_t)1) * SLOT_SIZE},
+            head{0},
+            tail{0},
+            closed{false},
+            failed{false},
+            sleepers{0}
+        {
+            void *data;
+            if (::posix_memalign(&data, SLOT_SIZE, capacity) != 0)
+            {
+                throw std::bad_alloc{};
+            }
+            ring.reset(static_cast<char *>(data));
+        }
+
+        void write(const char *data, size_t size)
+        {
+            while (size > 0)
+            {
+                auto position = tail.load(std::memory_order_relaxed);
+                wait_for([&] { return position - head.load(std::memory_order_acquire) < capacity; });
+
+                auto available = capacity - (position - head.load(std::memory_order_acquire));
+                auto offset = position % capacity;
+                auto length = std::min(std::min(size, available), capacity - offset);
+                std::memcpy(ring.get() + offset, data, length);
+                tail.store(position + length, std::memory_order_release);
+                wake();
+
+                data += length;
+                size -= length;
+            }
+        }
+
+        /**
+         * Body of the I/O thread: write the content of the ring to the sink until the ring is closed and empty.
+         * After an error, content is discarded so that the producer never blocks.
+         */
+        void drain()
+        {
+            for (;;)
+            {
+                auto position = head.load(std::memory_order_relaxed);
+                wait_for([&] {
+                    return tail.load(std::memory_order_acquire) != position || closed.load(std::memory_order_acquire);
+                });
+
+                auto end = tail.load(std::memory_order_acquire);
+                if (end == position) return;   // Closed and empty
+
+                auto offset = position % capacity;
+                auto length = std::min(end - position, capacity - offset);
+                if (!failed.load(std::memory_order_relaxed))
+                {
+                    try
+                    {
+                        sink.write(ring.get() + offset, length);
+                    }
+                    catch (...)
+                    {
+                        error = std::current_exception();
+                        failed.store(true, std::memory_order_release);
+                    }
+                }
+                head.store(position + length, std::memory_order_release);
+                wake();
+            }
+        }
+
+        void check_error()
+        {
+            if (failed.load(std::memory_order_acquire))
+            {
+                std::rethrow_exception(error);
+            }
+        }
+
+        /**
+         * Spin for a while, then sleep until ready() holds. The side making progress only takes the mutex when a
+         * thread announced it is about to sleep. Both sides may sleep at once (the producer on a full ring, the I/O
+         * thread once it drained it), so sleepers are counted: a flag cleared by one would hide the other.
+         */
+        template<typename Ready>
+        void wait_for(Ready ready)
+        {
+            for (auto i = 0; i < 64; ++i)
+            {
+                if (ready()) return;
+                std::this_thread::yield();
+            }
+
+            std::unique_lock<std::mutex> lock{mutex};
+            sleepers.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            condition.wait(lock, ready);
+            sleepers.fetch_sub(1);
+        }
+
+        void wake()
+        {
+            // Pairs with the fence of wait_for: either the sleeper sees the new position or this sees it counted.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (sleepers.load() != 0)
+            {
+                std::lock_guard<std::mutex> lock{mutex};
+                condition.notify_all();
+            }
+        }
+
+        Sink sink;
+        std::unique_ptr<char, FreeDeleter> ring;
+        size_t capacity;
+        // Positions are byte counts since the start, the producer only writes tail and the I/O thread only head.
+        // They are kept on separate cache lines.
+        char head_padding[CACHE_LINE_SIZE];
+        std::atomic<size_t> head;
+        char tail_padding[CACHE_LINE_SIZE];
+        std::atomic<size_t> tail;
+        char closed_padding[CACHE_LINE_SIZE];
+        std::atomic<bool> closed;
+        std::atomic<bool> failed;
+        std::exception_ptr error;
+        std::atomic<unsigned> sleepers;
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::thread thread;
+    };
+
+    void stop()
+    {
+        if (!state_->thread.joinable())
+        {
+            state_->check_error();
+            return;
+        }
+
+        state_->closed.store(true, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock{state_->mutex};
+            state_->condition.notify_all();
+        }
+        state_->thread.join();
+        state_->check_error();
+    }
+
+    void finish_sink(std::true_type)
+    {
+        state_->sink.finish();
+    }
+
+    void finish_sink(std::false_type)
+    {
+    }
+
+    std::unique_ptr<State> state_;
+};
+
+} // sink
+
+/**
+ * Tar whose caller only formats the archive, while a dedicated thread writes it to the given sink.
+ */
+template<typename Sink>
+using PipelinedTar = BasicTar<sink::PipelinedSink<Sink>>;
+
+} // tarpp
+
+#endif //TAR_PIPELINE_H
@@ -0,0 +1,98 @@
+#pragma once
+
+#ifndef TAR_PLAN_H
+#define TAR_PLAN_H
+
+#include <string>
+#include <vector>
+
+#include "tar.h"
+
+namespace tarpp {
+
+/**
+ * Location of an entry in a planned archive.
+ */
+struct EntryPlan
+{
+    size_t header_offset;   // Offset of the first header of the entry
+    size_t content_offset;  // Offset of the content, right after the headers
+    size_t size;            // Size of the content, without padding
+};
+
+/**
+ * Computes the exact layout of an archive without writing it.
+ * Entries are described the same way as with BasicTar::add and must be given in the same order, with the same
+ * blocking factor and format, for the plan to match the archive. Entries the format writes before a header (long
+ * names, extended attributes) are part of the plan.
+ */
+template<typename Format = UstarFormat>
+class BasicArchivePlanner
+{
+public:
+    explicit BasicArchivePlanner(size_t blocking_factor = details::DEFAULT_BLOCKING_FACTOR()) :
+        record_size_{details::record_size(blocking_factor)},
+        offset_{0}
+    {}
+
+    /**
+     * @return The location of the entry, by value: the entries() vector may move when further entries are added.
+     */
+    EntryPlan add(const std::string &tar_name, const std::string &content,
+                  const TarFileOptions &options = TarFileOptions{})
+    {
+        return add(tar_name, content.size(), options);
+    }
+
+    EntryPlan add(const std::string &tar_name, size_t size, const TarFileOptions &options = TarFileOptions{})
+    {
+        using namespace details::constants;
+
+        auto header_offset = offset_;
+        auto content_offset = header_offset + Format::extension(tar_name, size, options).size() + HEADER_SIZE;
+        offset_ = content_offset + size + details::padding_size(size);
+        entries_.push_back(EntryPlan{header_offset, content_offset, size});
+        return entries_.back();
+    }
+
+    /**
+     * Add every entry of a range of objects with name, content and options members, as accepted by
+     * BasicTar::add_batch.
+     */
+    template<typename Range>
+    void add_batch(const Range &entries)
+    {
+        for (const auto &entry : entries)
+        {
+            add(entry.name, entry.content.size(), entry.options);
+        }
+    }
+
+    const std::vector<EntryPlan> &entries() const { return entries_; }
+
+    /**
+     * Size of the entries, without the end-of-archive blocks.
+     */
+    size_t content_size() const { return offset_; }
+
+    /**
+     * Size of the finalized archive: entries, end-of-archive blocks and padding to a whole record.
+     */
+    size_t size() const
+    {
+        using namespace details::constants;
+        auto size = offset_ + 2 * BLOCK_SIZE;
+        return (size + record_size_ - 1) / record_size_ * record_size_;
+    }
+
+private:
+    size_t record_size_;
+    size_t offset_;
+    std::vector<EntryPlan> entries_;
+};
+
+using ArchivePlanner = BasicArchivePlanner<UstarFormat>;
+
+} // tarpp
+
+#endif //TAR_PLAN_H
@@ -0,0 +1,165 @@
+#pragma once
+
+#ifndef TAR_SCHEDULER_H
+#define TAR_SCHEDULER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace tarpp {
+namespace details {
+
+/**
+ * Pool of threads running tasks with work stealing.
+ * Every thread has its own queue. Tasks submitted by a task go to the queue of the thread running it, which takes its
+ * tasks from the front, in submission order. Other tasks are spread over the queues. A thread whose queue is empty
+ * steals from the back of the others, so that a thread busy with a large task does not hold back the small tasks
+ * queued behind it.
+ * Tasks must not throw. Tasks still queued when the scheduler is destroyed are discarded.
+ */
+class WorkStealingScheduler
+{
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkStealingScheduler(size_t thread_count) :
+        pending_{0},
+        next_queue_{0},
+        stopping_{false}
+    {
+        for (size_t i = 0; i < thread_count; ++i)
+        {
+            queues_.emplace_back(new Queue{});
+        }
+        for (size_t i = 0; i < thread_count; ++i)
+        {
+            threads_.emplace_back([this, i] { run(i); });
+        }
+    }
+
+    WorkStealingScheduler(const WorkStealingScheduler &) = delete;
+    WorkStealingScheduler &operator=(const WorkStealingScheduler &) = delete;
+
+    ~WorkStealingScheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            stopping_ = true;
+        }
+        task_ready_.notify_all();
+        for (auto &thread : threads_)
+        {
+            thread.join();
+        }
+    }
+
+    void submit(Task task)
+    {
+        auto &worker = current_worker();
+        size_t index;
+        if (worker.scheduler == this)
+        {
+            index = worker.index;
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            index = next_queue_++ % queues_.size();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock{queues_[index]->mutex};
+            queues_[index]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            ++pending_;
+        }
+        task_ready_.notify_one();
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    struct Worker
+    {
+        const WorkStealingScheduler *scheduler;
+        size_t index;
+    };
+
+    static Worker &current_worker()
+    {
+        static thread_local Worker worker{nullptr, 0};
+        return worker;
+    }
+
+    void run(size_t index)
+    {
+        current_worker() = Worker{this, index};
+        for (;;)
+        {
+            {
+                // Claim a task: it is in one of the queues, although maybe not yet visible to this thread.
+                std::unique_lock<std::mutex> lock{mutex_};
+                task_ready_.wait(lock, [this] { return stopping_ || pending_ > 0; });
+                if (stopping_) return;
+                --pending_;
+            }
+
+            auto task = Task{};
+            while (!take(index, task))
+            {
+                std::this_thread::yield();
+            }
+            task();
+        }
+    }
+
+    bool take(size_t index, Task &task)
+    {
+        {
+            auto &own = *queues_[index];
+            std::lock_guard<std::mutex> lock{own.mutex};
+            if (!own.tasks.empty())
+            {
+                task = std::move(own.tasks.front());
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < queues_.size(); ++i)
+        {
+            auto &victim = *queues_[(index + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock{victim.mutex};
+            if (!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.back());
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    size_t pending_;
+    size_t next_queue_;
+    bool stopping_;
+    std::mutex mutex_;
+    std::condition_variable task_ready_;
+    std::vector<std::thread> threads_;
+};
+
+}} // tarpp::details
+
+#endif //TAR_SCHEDULER_H
@@ -0,0 +1,94 @@
+#pragma once
+
+#ifndef TAR_SEGMENT_H
+#define TAR_SEGMENT_H
+
+#include <exception>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "io.h"
+#include "tar.h"
+
+namespace tarpp {
+
+/**
+ * Build the entries of an archive in segment_count independent segments, in parallel, and append them to tar in
+ * order. Segment i is built by calling build(i, segment_tar) on its own thread, where segment_tar writes to an
+ * anonymous temporary file in the format of tar. Segments are then stitched into tar with copy_file_range when its sink allows it, and
+ * the end-of-archive blocks are only written by tar.finalize().
+ * If a segment cannot be built, the first exception thrown by build is rethrown and nothing is added to tar.
+ */
+template<typename Sink, typename Format, typename F>
+void archive_segments(BasicTar<Sink, Format> &tar, size_t segment_count, F build)
+{
+    struct Segment
+    {
+        Segment() : fd{-1} {}
+
+        Segment(Segment &&other) :
+            fd{other.fd},
+            error{other.error}
+        {
+            other.fd = -1;
+        }
+
+        ~Segment()
+        {
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+        }
+
+        int fd;
+        std::exception_ptr error;
+    };
+
+    auto segments = std::vector<Segment>(segment_count);
+    auto threads = std::vector<std::thread>{};
+    for (size_t i = 0; i < segment_count; ++i)
+    {
+        threads.emplace_back([&segments, &build, i] {
+            auto &segment = segments[i];
+            try
+            {
+                segment.fd = io::make_temp_file();
+                auto segment_tar = BasicTar<sink::FdSink, Format>{segment.fd};
+                build(i, segment_tar);
+                segment_tar.finalize_segment();
+            }
+            catch (...)
+            {
+                segment.error = std::current_exception();
+            }
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    for (const auto &segment : segments)
+    {
+        if (segment.error)
+        {
+            std::rethrow_exception(segment.error);
+        }
+    }
+    for (const auto &segment : segments)
+    {
+        struct stat status;
+        if (::fstat(segment.fd, &status) != 0 || ::lseek(segment.fd, 0, SEEK_SET) < 0)
+        {
+            io::details::throw_errno("tarpp: cannot read archive segment");
+        }
+        tar.append_segment(segment.fd, static_cast<size_t>(status.st_size));
+    }
+}
+
+} // tarpp
+
+#endif //TAR_SEGMENT_H
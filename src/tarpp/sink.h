@@ -0,0 +1,397 @@
+#pragma once
+
+#ifndef TAR_SINK_H
+#define TAR_SINK_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <ostream>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "io.h"
+
+/**
+ * Sinks are the destinations a BasicTar writes to.
+ *
+ * A sink only has to provide:
+ *     void write(const char *data, size_t size);
+ *
+ * and may additionally provide the following capabilities, which the tar detects at compile time:
+ *     int native_handle() const;   // file descriptor the content of files can be copied to by the kernel
+ *     void writev(iovec *iov, size_t count);   // write several buffers at once (iov may be modified)
+ *     size_t copy_from(int fd, size_t size);   // copy size bytes from the current position of fd, return the count
+ *     bool seekable() const;           // whether patch() can be used
+ *     void patch(size_t offset, const char *data, size_t size);   // overwrite bytes already written at offset
+ *     void write_zeros(size_t size);   // write size zeros; such sinks bypass the tar's record buffer
+ *     void finish();                   // called once the archive is finalized
+ */
+
+namespace tarpp {
+namespace sink {
+
+/**
+ * Sink writing to a std::ostream, which must outlive the sink.
+ */
+class OStreamSink
+{
+public:
+    OStreamSink(std::ostream &output) :
+        output_{&output},
+        start_{output.tellp()}
+    {}
+
+    void write(const char *data, size_t size)
+    {
+        output_->write(data, size);
+    }
+
+    bool seekable() const
+    {
+        return start_ != std::streampos(-1);
+    }
+
+    void patch(size_t offset, const char *data, size_t size)
+    {
+        auto position = output_->tellp();
+        output_->seekp(start_ + static_cast<std::streamoff>(offset));
+        output_->write(data, size);
+        output_->seekp(position);
+    }
+
+private:
+    std::ostream *output_;
+    std::streampos start_;
+};
+
+/**
+ * Sink writing to a file descriptor, which is not closed by the sink.
+ */
+class FdSink
+{
+public:
+    FdSink(int fd) :
+        fd_{fd},
+        start_{::lseek(fd, 0, SEEK_CUR)}
+    {
+        auto flags = ::fcntl(fd, F_GETFL);
+        if (flags >= 0 && (flags & O_APPEND))
+        {
+            // pwrite appends to such files.
+            start_ = -1;
+        }
+    }
+
+    void write(const char *data, size_t size)
+    {
+        io::write_all(fd_, data, size);
+    }
+
+    void writev(iovec *iov, size_t count)
+    {
+        io::writev_all(fd_, iov, count);
+    }
+
+    int native_handle() const
+    {
+        return fd_;
+    }
+
+    bool seekable() const
+    {
+        return start_ >= 0;
+    }
+
+    void patch(size_t offset, const char *data, size_t size)
+    {
+        io::pwrite_all(fd_, data, size, start_ + static_cast<off_t>(offset));
+    }
+
+private:
+    int fd_;
+    off_t start_;
+};
+
+/**
+ * Sink writing to a memory-mapped regular file, whose previous content is discarded.
+ * The file is preallocated with the reserved size (the planned archive size, when known) and grown in large chunks
+ * when needed. Zeros cost nothing since fresh pages are already zero-filled. When the archive is finished the file
+ * is unmapped and truncated to the archive size. The file descriptor is not closed by the sink.
+ */
+class MmapSink
+{
+public:
+    enum
+    {
+        GROWTH_CHUNK_SIZE = 64 * 1024 * 1024
+    };
+
+    MmapSink(int fd, size_t reserved_size = 0) :
+        fd_{fd},
+        data_{nullptr},
+        capacity_{0},
+        size_{0}
+    {
+        if (::ftruncate(fd_, 0) != 0)
+        {
+            io::details::throw_errno("tarpp: cannot truncate archive file");
+        }
+        if (reserved_size > 0)
+        {
+            reserve(reserved_size);
+        }
+    }
+
+    MmapSink(MmapSink &&other) :
+        fd_{other.fd_},
+        data_{other.data_},
+        capacity_{other.capacity_},
+        size_{other.size_}
+    {
+        other.data_ = nullptr;
+        other.capacity_ = 0;
+    }
+
+    MmapSink(const MmapSink &) = delete;
+    MmapSink &operator=(const MmapSink &) = delete;
+
+    ~MmapSink()
+    {
+        if (data_)
+        {
+            ::munmap(data_, capacity_);
+            ::ftruncate(fd_, static_cast<off_t>(size_));
+        }
+    }
+
+    void write(const char *data, size_t size)
+    {
+        if (size == 0) return;
+        reserve(size_ + size);
+        std::memcpy(data_ + size_, data, size);
+        size_ += size;
+    }
+
+    void write_zeros(size_t size)
+    {
+        reserve(size_ + size);
+        size_ += size;
+    }
+
+    bool seekable() const
+    {
+        return true;
+    }
+
+    void patch(size_t offset, const char *data, size_t size)
+    {
+        std::memcpy(data_ + offset, data, size);
+    }
+
+    void finish()
+    {
+        if (data_)
+        {
+            ::munmap(data_, capacity_);
+            data_ = nullptr;
+            capacity_ = 0;
+        }
+        if (::ftruncate(fd_, static_cast<off_t>(size_)) != 0)
+        {
+            io::details::throw_errno("tarpp: cannot truncate archive file");
+        }
+    }
+
+    /**
+     * Number of bytes written to the file.
+     */
+    size_t size() const { return size_; }
+
+private:
+    void reserve(size_t size)
+    {
+        if (size <= capacity_) return;
+
+        auto page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        auto capacity = std::max(size, std::max(capacity_ * 2, (size_t)GROWTH_CHUNK_SIZE));
+        if (capacity_ == 0)
+        {
+            // The first reservation is exact, it is usually the planned size.
+            capacity = size;
+        }
+        capacity = (capacity + page_size - 1) / page_size * page_size;
+
+        allocate(capacity);
+
+        void *data;
+#ifdef __linux__
+        if (data_)
+        {
+            data = ::mremap(data_, capacity_, capacity, MREMAP_MAYMOVE);
+        }
+        else
+#endif
+        {
+            if (data_)
+            {
+                ::munmap(data_, capacity_);
+                data_ = nullptr;
+            }
+            data = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        }
+        if (data == MAP_FAILED)
+        {
+            io::details::throw_errno("tarpp: cannot map archive file");
+        }
+        data_ = static_cast<char *>(data);
+        capacity_ = capacity;
+    }
+
+    /**
+     * Make the file capacity bytes long, allocating disk blocks when the file system allows it so that running out
+     * of space is reported here instead of by a SIGBUS when writing to the mapping.
+     */
+    void allocate(size_t capacity)
+    {
+        auto result = ::posix_fallocate(fd_, 0, static_cast<off_t>(capacity));
+        if (result == 0) return;
+        if (result != EOPNOTSUPP && result != EINVAL)
+        {
+            errno = result;
+            io::details::throw_errno("tarpp: cannot allocate archive file");
+        }
+        if (::ftruncate(fd_, static_cast<off_t>(capacity)) != 0)
+        {
+            io::details::throw_errno("tarpp: cannot grow archive file");
+        }
+    }
+
+    int fd_;
+    char *data_;
+    size_t capacity_;
+    size_t size_;
+};
+
+/**
+ * Sink appending to a contiguous in-memory buffer, which must outlive the sink.
+ */
+class BufferSink
+{
+public:
+    BufferSink(std::vector<char> &buffer) :
+        buffer_{&buffer},
+        start_{buffer.size()}
+    {}
+
+    void write(const char *data, size_t size)
+    {
+        buffer_->insert(buffer_->end(), data, data + size);
+    }
+
+    bool seekable() const
+    {
+        return true;
+    }
+
+    void patch(size_t offset, const char *data, size_t size)
+    {
+        std::memcpy(buffer_->data() + start_ + offset, data, size);
+    }
+
+private:
+    std::vector<char> *buffer_;
+    size_t start_;
+};
+
+/**
+ * Sink handing every write to a callable taking (const char *data, size_t size).
+ */
+template<typename F>
+class CallbackSink
+{
+public:
+    CallbackSink(F callback) :
+        callback_(std::move(callback))
+    {}
+
+    void write(const char *data, size_t size)
+    {
+        callback_(data, size);
+    }
+
+private:
+    F callback_;
+};
+
+template<typename F>
+CallbackSink<typename std::decay<F>::type> make_callback_sink(F &&callback)
+{
+    return {std::forward<F>(callback)};
+}
+
+} // sink
+
+namespace details {
+
+template<typename...>
+struct void_type
+{
+    using type = void;
+};
+
+template<typename Sink, typename = void>
+struct has_native_handle : std::false_type {};
+
+template<typename Sink>
+struct has_native_handle<Sink, typename void_type<decltype(std::declval<const Sink &>().native_handle())>::type>
+    : std::true_type {};
+
+template<typename Sink, typename = void>
+struct has_copy_from : std::false_type {};
+
+template<typename Sink>
+struct has_copy_from<Sink, typename void_type<decltype(std::declval<Sink &>().copy_from(int{}, size_t{}))>::type>
+    : std::true_type {};
+
+template<typename Sink, typename = void>
+struct has_patch : std::false_type {};
+
+template<typename Sink>
+struct has_patch<Sink, typename void_type<decltype(std::declval<Sink &>().patch(size_t{}, std::declval<const char *>(), size_t{}))>::type>
+    : std::true_type {};
+
+template<typename Sink, typename = void>
+struct has_write_zeros : std::false_type {};
+
+template<typename Sink>
+struct has_write_zeros<Sink, typename void_type<decltype(std::declval<Sink &>().write_zeros(size_t{}))>::type>
+    : std::true_type {};
+
+template<typename Sink, typename = void>
+struct has_finish : std::false_type {};
+
+template<typename Sink>
+struct has_finish<Sink, typename void_type<decltype(std::declval<Sink &>().finish())>::type>
+    : std::true_type {};
+
+template<typename Sink, typename = void>
+struct has_writev : std::false_type {};
+
+template<typename Sink>
+struct has_writev<Sink, typename void_type<decltype(std::declval<Sink &>().writev(std::declval<iovec *>(), size_t{}))>::type>
+    : std::true_type {};
+
+template<typename Sink>
+struct can_copy_files : std::integral_constant<bool, has_native_handle<Sink>::value || has_copy_from<Sink>::value> {};
+
+} // details
+} // tarpp
+
+#endif //TAR_SINK_H
@@ -4,12 +4,26 @@
 #define TAR_TAR_H
 
 #include <algorithm>
-#include <numeric>
-#include <ostream>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <map>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
+#include "checksum.h"
+#include "dedup.h"
 #include "format.h"
+#include "io.h"
+#include "sink.h"
 #include "user.h"
 
 namespace tarpp {
@@ -56,7 +70,24 @@ enum
     HEADER_GNAME_OFFSET = HEADER_UNAME_OFFSET + HEADER_UNAME_SIZE,
     HEADER_DEVMAJOR_OFFSET = HEADER_GNAME_OFFSET + HEADER_GNAME_SIZE,
     HEADER_DEVMINOR_OFFSET = HEADER_DEVMAJOR_OFFSET + HEADER_DEVMAJOR_SIZE,
-    HEADER_PREFIX_OFFSET = HEADER_DEVMINOR_OFFSET + HEADER_DEVMINOR_SIZE
+    HEADER_PREFIX_OFFSET = HEADER_DEVMINOR_OFFSET + HEADER_DEVMINOR_SIZE,
+
+    STREAM_CHUNK_SIZE = 64 * 1024,
+
+    CLASSIC_BLOCKING_FACTOR = 20,
+
+    MAX_QUEUED_ENTRIES = 256,
+
+    SPILL_MEMORY_SIZE = 1024 * 1024,
+
+    // GNU sparse headers: the first segments of the map are in the header, the others in extension blocks
+    GNU_SPARSE_FIELD_SIZE = 12,
+    GNU_SPARSE_OFFSET = 386,
+    GNU_SPARSE_HEADER_SEGMENTS = 4,
+    GNU_SPARSE_IS_EXTENDED_OFFSET = 482,
+    GNU_SPARSE_REALSIZE_OFFSET = 483,
+    GNU_SPARSE_BLOCK_SEGMENTS = 21,
+    GNU_SPARSE_BLOCK_IS_EXTENDED_OFFSET = 504
 };
 
 } // constants
@@ -70,7 +101,12 @@ enum class FileType : char
     CHARACTER_SPECIAL_DEVICE,
     BLOCK_SPECIAL_DEVICE,
     DIRECTORY,
-    FIFO_SPECIAL_FILE
+    FIFO_SPECIAL_FILE,
+
+    GNU_LONG_LINKNAME = 'K',    // Link name of the next entry, too long for its header
+    GNU_LONG_NAME = 'L',        // Name of the next entry, too long for its header
+    GNU_SPARSE = 'S',           // Regular file whose holes are not stored, with the map of its data in the header
+    PAX_EXTENDED_HEADER = 'x'   // Attributes of the next entry, as pax records
 };
 
 namespace details {
@@ -117,6 +153,7 @@ struct TarHeader
 inline constexpr mode_t DEFAULT_MODE() { return S_IRUSR; }
 inline constexpr time_t DEFAULT_TIME() { return 0; }
 inline constexpr FileType DEFAULT_TYPE() { return FileType::REGULAR; }
+inline constexpr size_t DEFAULT_BLOCKING_FACTOR() { return 1; }
 
 inline void format_name(TarHeader& header, const std::string &name)
 {
@@ -136,6 +173,55 @@ inline void format_name(TarHeader& header, const std::string &name)
     }
 }
 
+/**
+ * Position of the '/' at which a name too long for the name field can be split between the prefix and name fields,
+ * as POSIX specifies, std::string::npos if there is none.
+ */
+inline size_t ustar_split(const std::string &name)
+{
+    using namespace constants;
+
+    if (name.size() <= HEADER_NAME_SIZE || name.size() > HEADER_PREFIX_SIZE + 1 + HEADER_NAME_SIZE)
+    {
+        return std::string::npos;
+    }
+
+    auto last = std::min(name.size() - 2, static_cast<size_t>(HEADER_PREFIX_SIZE));
+    for (auto position = name.size() - HEADER_NAME_SIZE - 1; position <= last; ++position)
+    {
+        if (name[position] == '/') return position;
+    }
+    return std::string::npos;
+}
+
+/**
+ * Number of zeros needed after content of the given size to reach the end of a block.
+ */
+inline constexpr size_t padding_size(size_t content_size)
+{
+    return (constants::BLOCK_SIZE - content_size % constants::BLOCK_SIZE) % constants::BLOCK_SIZE;
+}
+
+/**
+ * Format a pax extended header record: "<length> <key>=<value>\n", the length counting its own digits.
+ */
+inline std::string pax_record(const std::string &key, const std::string &value)
+{
+    auto length = key.size() + value.size() + 3;
+    auto total = length + std::to_string(length).size();
+    total = length + std::to_string(total).size();
+    return std::to_string(total) + " " + key + "=" + value + "\n";
+}
+
+inline size_t record_size(size_t blocking_factor)
+{
+    if (blocking_factor == 0)
+    {
+        throw std::invalid_argument("tarpp: the blocking factor must be at least 1");
+    }
+    return blocking_factor * constants::BLOCK_SIZE;
+}
+
 } // details
 
 class TarFileOptions
@@ -161,7 +247,9 @@ public:
         FileType type,
         std::string linkname,
         std::string username,
-        std::string groupname
+        std::string groupname,
+        unsigned int devmajor = 0,
+        unsigned int devminor = 0
     ) :
         mode_(mode),
         uid_(uid),
@@ -170,7 +258,9 @@ public:
         type_(type),
         linkname_(std::move(linkname)),
         username_(std::move(username)),
-        groupname_(std::move(groupname))
+        groupname_(std::move(groupname)),
+        devmajor_(devmajor),
+        devminor_(devminor)
     {}
 
     mode_t mode() const { return mode_; }
@@ -181,45 +271,55 @@ public:
     const std::string& linkname() const { return linkname_; }
     const std::string& username() const { return username_; }
     const std::string& groupname() const { return groupname_; }
+    /**
+     * Device numbers, only written for CHARACTER_SPECIAL_DEVICE and BLOCK_SPECIAL_DEVICE entries.
+     */
+    unsigned int devmajor() const { return devmajor_; }
+    unsigned int devminor() const { return devminor_; }
 
     TarFileOptions with_mode(mode_t m) const
     {
-        return {m, uid_, gid_, mtime_, type_, linkname_, username_, groupname_};
+        return {m, uid_, gid_, mtime_, type_, linkname_, username_, groupname_, devmajor_, devminor_};
     }
 
     TarFileOptions with_uid(uid_t u) const
     {
-        return {mode_, u, gid_, mtime_, type_, linkname_, username_, groupname_};
+        return {mode_, u, gid_, mtime_, type_, linkname_, username_, groupname_, devmajor_, devminor_};
     }
 
     TarFileOptions with_gid(gid_t g) const
     {
-        return {mode_, uid_, g, mtime_, type_, linkname_, username_, groupname_};
+        return {mode_, uid_, g, mtime_, type_, linkname_, username_, groupname_, devmajor_, devminor_};
     }
 
     TarFileOptions with_mtime(time_t t) const
     {
-        return {mode_, uid_, gid_, t, type_, linkname_, username_, groupname_};
+        return {mode_, uid_, gid_, t, type_, linkname_, username_, groupname_, devmajor_, devminor_};
     }
 
     TarFileOptions with_type(FileType t) const
     {
-        return {mode_, uid_, gid_, mtime_, t, linkname_, username_, groupname_};
+        return {mode_, uid_, gid_, mtime_, t, linkname_, username_, groupname_, devmajor_, devminor_};
     }
 
     TarFileOptions with_linkname(std::string linkname) const
     {
-        return {mode_, uid_, gid_, mtime_, type_, std::move(linkname), username_, groupname_};
+        return {mode_, uid_, gid_, mtime_, type_, std::move(linkname), username_, groupname_, devmajor_, devminor_};
     }
 
     TarFileOptions with_username(std::string username) const
     {
-        return {mode_, uid_, gid_, mtime_, type_, linkname_, std::move(username), groupname_};
+        return {mode_, uid_, gid_, mtime_, type_, linkname_, std::move(username), groupname_, devmajor_, devminor_};
     }
 
     TarFileOptions with_groupname(std::string groupname) const
     {
-        return {mode_, uid_, gid_, mtime_, type_, linkname_, username_, std::move(groupname)};
+        return {mode_, uid_, gid_, mtime_, type_, linkname_, username_, std::move(groupname), devmajor_, devminor_};
+    }
+
+    TarFileOptions with_device(unsigned int devmajor, unsigned int devminor) const
+    {
+        return {mode_, uid_, gid_, mtime_, type_, linkname_, username_, groupname_, devmajor, devminor};
     }
 
 private:
@@ -231,74 +331,1773 @@ private:
     std::string linkname_;
     std::string username_;
     std::string groupname_;
+    unsigned int devmajor_;
+    unsigned int devminor_;
 };
 
-class Tar
+namespace details {
+
+inline void set_checksum(TarHeader &header)
 {
-    static_assert(sizeof(details::TarHeader) == details::constants::HEADER_SIZE, "Invalid tar header size.");
-public:
-    explicit Tar(std::ostream &output) :
-        output_{&output}
-    {}
+    std::fill(std::begin(header.header_.chksum_), std::end(header.header_.chksum_), ' ');
+    format::format_octal(header.header_.chksum_, unsigned_checksum(header.data_));
+}
+
+/**
+ * Check the checksum stored in a header read from an archive. Both the unsigned and the signed sums are accepted, as
+ * some implementations used the latter.
+ */
+inline bool verify_checksum(const TarHeader &header)
+{
+    const auto &field = header.header_.chksum_;
+    auto position = std::begin(field);
+    while (position != std::end(field) && *position == ' ') ++position;
+
+    int32_t stored = 0;
+    auto digits = 0;
+    for (; position != std::end(field) && *position >= '0' && *position <= '7'; ++position, ++digits)
+    {
+        stored = stored * 8 + (*position - '0');
+    }
+    if (digits == 0) return false;
+
+    // The checksum field itself is summed as if it contained spaces.
+    int32_t unsigned_field = 0;
+    int32_t signed_field = 0;
+    for (auto c : field)
+    {
+        unsigned_field += static_cast<unsigned char>(c) - ' ';
+        signed_field += static_cast<signed char>(c) - ' ';
+    }
+    return stored == static_cast<int32_t>(unsigned_checksum(header.data_)) - unsigned_field ||
+           stored == signed_checksum(header.data_) - signed_field;
+}
+
+/**
+ * @return Whether value can be written as an octal number of at most digits digits.
+ */
+template<typename T>
+bool octal_fits(T value, size_t digits)
+{
+    using Unsigned = typename std::make_unsigned<T>::type;
+    return !(std::is_signed<T>::value && value < T{}) &&
+           format::details::octal_digits(static_cast<Unsigned>(value)) <= digits;
+}
+
+/**
+ * Format value in a numeric field as a '0' filled octal number, null terminated or taking the whole field.
+ * @return false, leaving the field untouched, if the value does not fit.
+ */
+template<typename T, size_t N>
+bool format_number(char (&field)[N], T value, bool terminated)
+{
+    if (!octal_fits(value, terminated ? N - 1 : N)) return false;
+
+    if (terminated)
+    {
+        format::format_octal(field, value);
+    }
+    else
+    {
+        format::format_octal_no_null(field, value);
+    }
+    return true;
+}
+
+/**
+ * Report a field of an entry which its header cannot hold.
+ */
+inline void check_field(bool stored, const char *field)
+{
+    if (!stored)
+    {
+        throw std::length_error(std::string{"tarpp: the "} + field + " of the entry does not fit in its header");
+    }
+}
+
+/**
+ * Numeric fields which must hold their value.
+ */
+struct StrictNumbers
+{
+    template<typename T, size_t N>
+    static void format(char (&field)[N], T value, bool terminated, const char *name)
+    {
+        check_field(format_number(field, value, terminated), name);
+    }
+};
 
-    ~Tar()
+/**
+ * Numeric fields whose value is recorded elsewhere when it does not fit: the field is then set to 0.
+ */
+struct ExtendedNumbers
+{
+    template<typename T, size_t N>
+    static void format(char (&field)[N], T value, bool terminated, const char *)
     {
-        if (output_)
+        if (!format_number(field, value, terminated))
         {
-            finalize();
+            format_number(field, 0, terminated);
         }
     }
+};
 
-    void add(const std::string &tar_name, const std::string &content, const TarFileOptions &options = TarFileOptions{})
+/**
+ * Numeric fields as GNU tar writes them: octal numbers up to 11 digits long followed by a null character, GNU's
+ * base-256 encoding (see format::format_base256) for the values which do not fit.
+ */
+struct Base256Numbers
+{
+    template<typename T, size_t N>
+    static void format(char (&field)[N], T value, bool, const char *name)
     {
-        using namespace details::constants;
-        using namespace details;
-        using namespace format;
-
-        if (!output_) return;
-
-        auto header = TarHeader{};
-        //format_string_opt_null(header.header_.name_, tar_name);
-        format_name(header, tar_name);
-        format_octal(header.header_.mode_, options.mode());
-        format_octal(header.header_.uid_, options.uid());
-        format_octal(header.header_.gid_, options.gid());
-        format_octal_no_null(header.header_.size_, content.size());
-        format_octal_no_null(header.header_.mtime_, options.mtime());
+        if (!format_number(field, value, true))
+        {
+            check_field(format::format_base256(field, value), name);
+        }
+    }
+};
+
+inline bool is_device(FileType type)
+{
+    return type == FileType::CHARACTER_SPECIAL_DEVICE || type == FileType::BLOCK_SPECIAL_DEVICE;
+}
+
+/**
+ * Format the fields of a ustar header which only depend on the options. The link name is truncated, and the device
+ * numbers are only written for devices.
+ */
+template<typename Numbers>
+void format_ustar_option_fields(TarHeader &header, const TarFileOptions &options)
+{
+    Numbers::format(header.header_.mode_, options.mode(), true, "mode");
+    Numbers::format(header.header_.uid_, options.uid(), true, "uid");
+    Numbers::format(header.header_.gid_, options.gid(), true, "gid");
+    header.header_.type_[0] = static_cast<char>(options.type());
+    format::format_string_opt_null(header.header_.linkname_, options.linkname());
+    format::format_string(header.header_.uname_, options.username());
+    format::format_string(header.header_.gname_, options.groupname());
+    if (is_device(options.type()))
+    {
+        Numbers::format(header.header_.devmajor_, options.devmajor(), true, "device major number");
+        Numbers::format(header.header_.devminor_, options.devminor(), true, "device minor number");
+    }
+}
+
+/*
+ * Encodings of files with holes.
+ */
+struct PaxSparse {};    // pax GNU.sparse 1.0 records
+struct GnuSparse {};    // GNU_SPARSE entries
+struct NoSparse {};     // Holes are stored as zeros
+
+/**
+ * Entry holding attributes of the next one (long names, pax records): a header of the given format, name and type,
+ * followed by the content padded to a block.
+ */
+template<typename Format>
+std::string extension_entry(const std::string &name, FileType type, const std::string &content)
+{
+    auto header = TarHeader{};
+    Format::format_option_fields(header, TarFileOptions{0644, 0, 0, 0, type, "", "", ""});
+    Format::format_entry_fields(header, name, content.size(), 0);
+    set_checksum(header);
+
+    auto entry = std::string(header.data_, constants::HEADER_SIZE) + content;
+    entry.append(padding_size(content.size()), '\0');
+    return entry;
+}
+
+} // details
+
+/**
+ * Archive formats, selected at compile time by the Format parameter of BasicTar. A format provides:
+ *     // Header fields which only depend on the options: magic, mode, uid, gid, type, linkname, uname and gname.
+ *     static void format_option_fields(details::TarHeader &header, const TarFileOptions &options);
+ *     // Header fields specific to each entry: name, size and mtime.
+ *     static void format_entry_fields(details::TarHeader &header, const std::string &tar_name, size_t size,
+ *                                     time_t mtime);
+ *     // Entries to write before the header of an entry (long names, extended attributes), empty if none.
+ *     static std::string extension(const std::string &tar_name, size_t size, const TarFileOptions &options);
+ *     // How files with holes are stored (see BasicTar::add_sparse_file).
+ *     using sparse_encoding = details::PaxSparse, details::GnuSparse or details::NoSparse;
+ *     // Longest link name the format stores in full, so that links to an entry can be made.
+ *     static constexpr size_t max_linkname_size();
+ * Formats using PaxSparse also provide the pax records their header needs, merged with the sparse records:
+ *     static std::string pax_records(const std::string &tar_name, size_t size, const TarFileOptions &options);
+ * Values a format cannot store are reported as std::length_error.
+ */
+
+/**
+ * Unix V7 format: names and link names of up to 100 bytes, no magic, no owner names and no device numbers.
+ */
+struct V7Format
+{
+    static void format_option_fields(details::TarHeader &header, const TarFileOptions &options)
+    {
+        using details::StrictNumbers;
+
+        std::fill(std::begin(header.header_.magic_), std::end(header.header_.magic_), '\0');
+        std::fill(std::begin(header.header_.version_), std::end(header.header_.version_), '\0');
+        StrictNumbers::format(header.header_.mode_, options.mode(), true, "mode");
+        StrictNumbers::format(header.header_.uid_, options.uid(), true, "uid");
+        StrictNumbers::format(header.header_.gid_, options.gid(), true, "gid");
         header.header_.type_[0] = static_cast<char>(options.type());
-        format_string_opt_null(header.header_.linkname_, options.linkname());
-        format_string(header.header_.uname_, options.username());
-        format_string(header.header_.gname_, options.groupname());
+        details::check_field(options.linkname().size() <= details::constants::HEADER_LINKNAME_SIZE, "link name");
+        format::format_string_opt_null(header.header_.linkname_, options.linkname());
+        details::check_field(!details::is_device(options.type()) ||
+                             (options.devmajor() == 0 && options.devminor() == 0), "device number");
+    }
+
+    static void format_entry_fields(details::TarHeader &header, const std::string &tar_name, size_t size, time_t mtime)
+    {
+        using details::StrictNumbers;
+
+        details::check_field(tar_name.size() <= details::constants::HEADER_NAME_SIZE, "name");
+        format::format_string_opt_null(header.header_.name_, tar_name);
+        StrictNumbers::format(header.header_.size_, size, false, "size");
+        StrictNumbers::format(header.header_.mtime_, mtime, false, "modification time");
+    }
+
+    static std::string extension(const std::string &, size_t, const TarFileOptions &) { return {}; }
+
+    using sparse_encoding = details::NoSparse;
+
+    static constexpr size_t max_linkname_size() { return details::constants::HEADER_LINKNAME_SIZE; }
+};
+
+/**
+ * ustar format, the default: names longer than 100 bytes continue in the prefix field, and are truncated beyond.
+ */
+struct UstarFormat
+{
+    static void format_option_fields(details::TarHeader &header, const TarFileOptions &options)
+    {
+        details::format_ustar_option_fields<details::StrictNumbers>(header, options);
+    }
+
+    static void format_entry_fields(details::TarHeader &header, const std::string &tar_name, size_t size, time_t mtime)
+    {
+        using details::StrictNumbers;
+
+        details::format_name(header, tar_name);
+        StrictNumbers::format(header.header_.size_, size, false, "size");
+        StrictNumbers::format(header.header_.mtime_, mtime, false, "modification time");
+    }
+
+    static std::string extension(const std::string &, size_t, const TarFileOptions &) { return {}; }
+
+    using sparse_encoding = details::PaxSparse;
+
+    /**
+     * Longer link names are truncated.
+     */
+    static constexpr size_t max_linkname_size() { return details::constants::HEADER_LINKNAME_SIZE; }
+
+    /**
+     * No records: the header holds everything itself.
+     */
+    static std::string pax_records(const std::string &, size_t, const TarFileOptions &) { return {}; }
+};
+
+/**
+ * GNU format: names and link names longer than 100 bytes are stored in GNU_LONG_NAME and GNU_LONG_LINKNAME entries
+ * written before the header, and numbers which do not fit in octal are written in base-256, so sizes over 8 GiB and
+ * large uids and gids fit in the header itself.
+ */
+struct GnuFormat
+{
+    static void format_option_fields(details::TarHeader &header, const TarFileOptions &options)
+    {
+        using namespace details::constants;
+
+        details::format_ustar_option_fields<details::Base256Numbers>(header, options);
+        std::memcpy(header.header_.magic_, "ustar ", HEADER_MAGIC_SIZE);
+        std::memcpy(header.header_.version_, " ", HEADER_VERSION_SIZE);
+    }
+
+    static void format_entry_fields(details::TarHeader &header, const std::string &tar_name, size_t size, time_t mtime)
+    {
+        using details::Base256Numbers;
+
+        format::format_string_opt_null(header.header_.name_, tar_name);
+        Base256Numbers::format(header.header_.size_, size, false, "size");
+        Base256Numbers::format(header.header_.mtime_, mtime, false, "modification time");
+    }
+
+    static std::string extension(const std::string &tar_name, size_t, const TarFileOptions &options)
+    {
+        using namespace details::constants;
+
+        const auto long_name = "././@LongLink";
+        auto result = std::string{};
+        if (options.linkname().size() > HEADER_LINKNAME_SIZE)
+        {
+            result += details::extension_entry<GnuFormat>(long_name, FileType::GNU_LONG_LINKNAME,
+                                                          options.linkname() + '\0');
+        }
+        if (tar_name.size() > HEADER_NAME_SIZE)
+        {
+            result += details::extension_entry<GnuFormat>(long_name, FileType::GNU_LONG_NAME, tar_name + '\0');
+        }
+        return result;
+    }
 
-        set_checksum(header);
+    using sparse_encoding = details::GnuSparse;
 
-        output_->write(header.data_, HEADER_SIZE);
-        *output_ << content;
+    static constexpr size_t max_linkname_size() { return std::numeric_limits<size_t>::max(); }
+};
+
+/**
+ * POSIX pax format: a ustar header, with names split at a '/' between the prefix and name fields, preceded by a
+ * PAX_EXTENDED_HEADER entry holding the names, numbers and owner names it cannot store.
+ */
+struct PaxFormat
+{
+    static void format_option_fields(details::TarHeader &header, const TarFileOptions &options)
+    {
+        details::format_ustar_option_fields<details::ExtendedNumbers>(header, options);
+    }
+
+    static void format_entry_fields(details::TarHeader &header, const std::string &tar_name, size_t size, time_t mtime)
+    {
+        using details::ExtendedNumbers;
 
-        auto padding_size = BLOCK_SIZE - (content.size() % BLOCK_SIZE);
-        if (padding_size != BLOCK_SIZE) {
-            std::fill_n(std::ostream_iterator<char>(*output_), padding_size, 0);
+        auto split = details::ustar_split(tar_name);
+        if (split == std::string::npos)
+        {
+            // Names which do not fit are recorded by a "path" record.
+            format::format_string_opt_null(header.header_.name_, tar_name);
         }
+        else
+        {
+            std::copy(tar_name.begin(), tar_name.begin() + split, header.header_.prefix_);
+            std::copy(tar_name.begin() + split + 1, tar_name.end(), header.header_.name_);
+        }
+        ExtendedNumbers::format(header.header_.size_, size, false, "size");
+        ExtendedNumbers::format(header.header_.mtime_, mtime, false, "modification time");
     }
 
-    void finalize()
+    static std::string extension(const std::string &tar_name, size_t size, const TarFileOptions &options)
+    {
+        auto records = pax_records(tar_name, size, options);
+        if (records.empty()) return records;
+
+        auto base_name = tar_name.substr(0, tar_name.find_last_not_of('/') + 1);
+        base_name = base_name.substr(base_name.rfind('/') + 1);
+        return details::extension_entry<PaxFormat>("PaxHeaders.0/" + base_name, FileType::PAX_EXTENDED_HEADER, records);
+    }
+
+    using sparse_encoding = details::PaxSparse;
+
+    static constexpr size_t max_linkname_size() { return std::numeric_limits<size_t>::max(); }
+
+    /**
+     * Records for the values the ustar header of the entry cannot store.
+     */
+    static std::string pax_records(const std::string &tar_name, size_t size, const TarFileOptions &options)
     {
         using namespace details::constants;
-        std::fill_n(std::ostream_iterator<char>(*output_), BLOCK_SIZE * 2, 0);
-        output_ = nullptr;
+        using details::octal_fits;
+        using details::pax_record;
+
+        auto records = std::string{};
+        if (tar_name.size() > HEADER_NAME_SIZE && details::ustar_split(tar_name) == std::string::npos)
+        {
+            records += pax_record("path", tar_name);
+        }
+        if (options.linkname().size() > HEADER_LINKNAME_SIZE)
+        {
+            records += pax_record("linkpath", options.linkname());
+        }
+        if (!octal_fits(size, HEADER_SIZE_SIZE))
+        {
+            records += pax_record("size", std::to_string(size));
+        }
+        if (!octal_fits(options.uid(), HEADER_UID_SIZE - 1))
+        {
+            records += pax_record("uid", std::to_string(options.uid()));
+        }
+        if (!octal_fits(options.gid(), HEADER_GID_SIZE - 1))
+        {
+            records += pax_record("gid", std::to_string(options.gid()));
+        }
+        if (!octal_fits(options.mtime(), HEADER_MTIME_SIZE))
+        {
+            records += pax_record("mtime", std::to_string(options.mtime()));
+        }
+        if (options.username().size() >= HEADER_UNAME_SIZE)
+        {
+            records += pax_record("uname", options.username());
+        }
+        if (options.groupname().size() >= HEADER_GNAME_SIZE)
+        {
+            records += pax_record("gname", options.groupname());
+        }
+        // pax has no standard record for device numbers: those of star and GNU tar.
+        if (details::is_device(options.type()) && !octal_fits(options.devmajor(), HEADER_DEVMAJOR_SIZE - 1))
+        {
+            records += pax_record("SCHILY.devmajor", std::to_string(options.devmajor()));
+        }
+        if (details::is_device(options.type()) && !octal_fits(options.devminor(), HEADER_DEVMINOR_SIZE - 1))
+        {
+            records += pax_record("SCHILY.devminor", std::to_string(options.devminor()));
+        }
+        return records;
+    }
+};
+
+namespace details {
+
+/**
+ * Format every header field except the checksum.
+ */
+template<typename Format = UstarFormat>
+void format_fields(TarHeader &header, const std::string &tar_name, size_t size, const TarFileOptions &options)
+{
+    Format::format_option_fields(header, options);
+    Format::format_entry_fields(header, tar_name, size, options.mtime());
+}
+
+/**
+ * Format a header. Entries the format needs before it (Format::extension) are not included.
+ */
+template<typename Format = UstarFormat>
+void format_header(TarHeader &header, const std::string &tar_name, size_t size, const TarFileOptions &options)
+{
+    format_fields<Format>(header, tar_name, size, options);
+    set_checksum(header);
+}
+
+/**
+ * Header prepared with the fields which only depend on the entry options, reused while consecutive entries have the
+ * same options (modification time aside). Per entry, only the name, size and mtime fields are written, and the
+ * checksum is the one of the prototype plus the bytes of those fields.
+ */
+template<typename Format>
+class HeaderPrototype
+{
+public:
+    HeaderPrototype() :
+        options_{0, 0, 0, 0, FileType::REGULAR, "", "", ""},
+        checksum_{0},
+        prepared_{false}
+    {}
+
+    /**
+     * Format header as format_header<Format> would.
+     */
+    void format(TarHeader &header, const std::string &tar_name, size_t size, const TarFileOptions &options)
+    {
+        using namespace constants;
+
+        if (!prepared_ || !same_fields(options))
+        {
+            prepare(options);
+        }
+
+        header = prototype_;
+        Format::format_entry_fields(header, tar_name, size, options.mtime());
+
+        // The name and prefix fields of the prototype are zeros, and the format writes at most tar_name.size() bytes
+        // in each, wherever it splits the name: the bytes past that cannot have changed.
+        auto name_size = std::min(tar_name.size(), static_cast<size_t>(HEADER_NAME_SIZE));
+        auto prefix_size = std::min(tar_name.size(), static_cast<size_t>(HEADER_PREFIX_SIZE));
+        auto checksum = checksum_ + sum(header.header_.name_, name_size) + sum(header.header_.prefix_, prefix_size) +
+                        sum(header.header_.size_, HEADER_SIZE_SIZE) + sum(header.header_.mtime_, HEADER_MTIME_SIZE);
+        format::format_octal(header.header_.chksum_, checksum);
     }
 
 private:
-    void set_checksum(details::TarHeader& header)
+    static uint32_t sum(const char *field, size_t size)
+    {
+        uint32_t result = 0;
+        for (size_t i = 0; i < size; ++i)
+        {
+            result += static_cast<unsigned char>(field[i]);
+        }
+        return result;
+    }
+
+    bool same_fields(const TarFileOptions &options) const
+    {
+        return options.mode() == options_.mode() && options.uid() == options_.uid() &&
+               options.gid() == options_.gid() && options.type() == options_.type() &&
+               options.linkname() == options_.linkname() && options.username() == options_.username() &&
+               options.groupname() == options_.groupname() && options.devmajor() == options_.devmajor() &&
+               options.devminor() == options_.devminor();
+    }
+
+    void prepare(const TarFileOptions &options)
+    {
+        prototype_ = TarHeader{};
+        Format::format_option_fields(prototype_, options);
+        std::fill(std::begin(prototype_.header_.chksum_), std::end(prototype_.header_.chksum_), ' ');
+        checksum_ = unsigned_checksum(prototype_.data_);
+        options_ = options;
+        prepared_ = true;
+    }
+
+    TarHeader prototype_;
+    TarFileOptions options_;
+    uint32_t checksum_;
+    bool prepared_;
+};
+
+/**
+ * Attributes of a regular entry which its header records. A hard link shares them with its target on extraction,
+ * so entries are only deduplicated when they are equal.
+ */
+struct FileAttributes
+{
+    explicit FileAttributes(const TarFileOptions &options) :
+        mode(options.mode()),
+        uid(options.uid()),
+        gid(options.gid()),
+        mtime(options.mtime()),
+        username(options.username()),
+        groupname(options.groupname())
+    {}
+
+    bool operator==(const FileAttributes &other) const
+    {
+        return mode == other.mode && uid == other.uid && gid == other.gid && mtime == other.mtime &&
+               username == other.username && groupname == other.groupname;
+    }
+
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    std::string username;
+    std::string groupname;
+};
+
+/**
+ * Names under which files with several hard links were archived, by device and inode.
+ */
+class HardLinks
+{
+public:
+    /**
+     * @param max_linkname_size Longest name links can be made to (see Format::max_linkname_size()).
+     */
+    explicit HardLinks(size_t max_linkname_size = std::numeric_limits<size_t>::max()) :
+        max_linkname_size_{max_linkname_size}
+    {}
+
+    /**
+     * @return The name the file with the given status was archived as, nullptr if it was not.
+     */
+    const std::string *find(const struct stat &status) const
+    {
+        if (!S_ISREG(status.st_mode) || status.st_nlink < 2) return nullptr;
+
+        auto position = names_.find(std::make_pair(status.st_dev, status.st_ino));
+        return position == names_.end() ? nullptr : &position->second;
+    }
+
+    /**
+     * Record that the file with the given status was archived, with its content, as tar_name. To be called once
+     * the entry is complete, so that links are only made to complete entries. Names too long for a link name are
+     * not recorded: the next link to the file is archived with its content instead.
+     */
+    void record(const struct stat &status, const std::string &tar_name)
     {
-        std::fill(std::begin(header.header_.chksum_), std::end(header.header_.chksum_), ' ');
-        int64_t chksum = std::accumulate(std::begin(header.data_), std::end(header.data_), int64_t{0});
-        format::format_octal(header.header_.chksum_, chksum);
+        if (!S_ISREG(status.st_mode) || status.st_nlink < 2 || tar_name.size() > max_linkname_size_) return;
+
+        names_.emplace(std::make_pair(status.st_dev, status.st_ino), tar_name);
     }
 
-    std::ostream *output_;
+private:
+    size_t max_linkname_size_;
+    std::map<std::pair<dev_t, ino_t>, std::string> names_;
+};
+
+} // details
+
+/**
+ * An in-memory entry, as accepted by BasicTar::add_batch.
+ */
+struct TarEntry
+{
+    std::string name;
+    std::string content;
+    TarFileOptions options;
 };
 
+/**
+ * Tar archive writer, generic over the sink the archive is written to (see sink.h).
+ *
+ * Data reaches the sink in records of blocking_factor blocks, and the finalized archive is padded to a whole
+ * number of records. The default of one block per record hands every block to the sink as soon as it is complete;
+ * tape and pipe consumers usually expect tar's classic 20 blocks (CLASSIC_BLOCKING_FACTOR) or more.
+ *
+ * Headers are written in the given Format (V7Format, UstarFormat, GnuFormat or PaxFormat).
+ */
+template<typename Sink, typename Format = UstarFormat>
+class BasicTar
+{
+    static_assert(sizeof(details::TarHeader) == details::constants::HEADER_SIZE, "Invalid tar header size.");
+public:
+    explicit BasicTar(Sink sink, size_t blocking_factor = details::DEFAULT_BLOCKING_FACTOR()) :
+        sink_(std::move(sink)),
+        open_{true},
+        entry_open_{false},
+        spill_limit_{std::numeric_limits<size_t>::max()},
+        record_(details::record_size(blocking_factor)),
+        record_used_{0},
+        offset_{0},
+        links_{Format::max_linkname_size()}
+    {}
+
+    BasicTar(BasicTar &&other) :
+        sink_(std::move(other.sink_)),
+        open_{other.open_},
+        entry_open_{other.entry_open_},
+        spill_limit_{other.spill_limit_},
+        record_(std::move(other.record_)),
+        record_used_{other.record_used_},
+        offset_{other.offset_},
+        queue_(std::move(other.queue_)),
+        batch_(std::move(other.batch_)),
+        prototype_(std::move(other.prototype_)),
+        links_(std::move(other.links_)),
+        dedup_(std::move(other.dedup_))
+    {
+        other.open_ = false;
+    }
+
+    BasicTar(const BasicTar &) = delete;
+    BasicTar &operator=(const BasicTar &) = delete;
+
+    /**
+     * Finalize the archive if needed. Errors are ignored: call finalize() explicitly to get them.
+     */
+    ~BasicTar()
+    {
+        if (open_)
+        {
+            try
+            {
+                finalize();
+            }
+            catch (...)
+            {
+            }
+        }
+    }
+
+    Sink &sink() { return sink_; }
+    const Sink &sink() const { return sink_; }
+
+    /**
+     * Number of bytes of archive written so far, including those still held in the record buffer.
+     */
+    size_t offset() const { return offset_; }
+
+    /**
+     * Add an entry from in-memory content.
+     * With sinks supporting writev, the header, content and padding (along with any queued entry) are emitted by a
+     * single gathered write.
+     */
+    void add(const std::string &tar_name, const std::string &content, const TarFileOptions &options = TarFileOptions{})
+    {
+        if (!open_) return;
+
+        check_no_open_entry();
+        if (auto target = find_duplicate(content, options))
+        {
+            add_content(tar_name, std::string{}, link_options(options, *target), details::has_writev<Sink>{});
+            return;
+        }
+        add_content(tar_name, content, options, details::has_writev<Sink>{});
+        index_content(tar_name, content, options);
+    }
+
+    /**
+     * Queue an entry so that it is written, together with the following queued entries, by a single gathered write.
+     * The content is not copied: it must stay valid and unchanged until the queue is flushed, which happens on
+     * flush_queue(), finalize(), any add, or when the queue holds MAX_QUEUED_ENTRIES entries.
+     * Sinks that do not support writev write the entry immediately.
+     */
+    void queue(const std::string &tar_name, const std::string &content, const TarFileOptions &options = TarFileOptions{})
+    {
+        if (!open_) return;
+
+        check_no_open_entry();
+        if (auto target = find_duplicate(content, options))
+        {
+            static const std::string no_content;
+            queue_content(tar_name, no_content, link_options(options, *target), details::has_writev<Sink>{});
+            return;
+        }
+        queue_content(tar_name, content, options, details::has_writev<Sink>{});
+        index_content(tar_name, content, options);
+    }
+
+    /**
+     * Write all the queued entries.
+     */
+    void flush_queue()
+    {
+        if (queue_.empty()) return;
+
+        write_queue(details::has_writev<Sink>{});
+    }
+
+    /**
+     * Add a batch of in-memory entries. entries is a forward range of objects with name, content and options
+     * members, such as TarEntry.
+     * The whole batch is laid out in one contiguous buffer which is written at once.
+     */
+    template<typename Range>
+    void add_batch(const Range &entries)
+    {
+        using namespace details::constants;
+
+        if (!open_) return;
+
+        check_no_open_entry();
+        flush_queue();
+
+        auto total = size_t{0};
+        for (const auto &entry : entries)
+        {
+            total += Format::extension(entry.name, entry.content.size(), entry.options).size() + HEADER_SIZE +
+                     entry.content.size() + details::padding_size(entry.content.size());
+        }
+
+        batch_.assign(total, 0);
+        auto position = batch_.data();
+        for (const auto &entry : entries)
+        {
+            auto extension = Format::extension(entry.name, entry.content.size(), entry.options);
+            std::memcpy(position, extension.data(), extension.size());
+            position += extension.size();
+
+            auto header = new (position) details::TarHeader{};
+            prototype_.format(*header, entry.name, entry.content.size(), entry.options);
+
+            position += HEADER_SIZE;
+            std::memcpy(position, entry.content.data(), entry.content.size());
+            position += entry.content.size() + details::padding_size(entry.content.size());
+        }
+
+        write_data(batch_.data(), batch_.size());
+    }
+
+    /**
+     * Add an entry whose content is read from a stream in fixed-size chunks, so memory use does not depend on the
+     * size of the entry.
+     * If the stream ends before size bytes could be read, the entry is completed with zeros (so the archive stays
+     * readable) and std::runtime_error is thrown.
+     */
+    void add(const std::string &tar_name, std::istream &content, size_t size, const TarFileOptions &options = TarFileOptions{})
+    {
+        if (!open_) return;
+
+        stream_entry(tar_name, size, options, [&content](char *buffer, size_t length) -> size_t {
+            content.read(buffer, length);
+            return static_cast<size_t>(content.gcount());
+        });
+    }
+
+    /**
+     * Add an entry whose content is read from a file descriptor in fixed-size chunks, so memory use does not depend
+     * on the size of the entry. Reading starts at the current position of fd.
+     * If fd reaches end of file before size bytes could be read, the entry is completed with zeros (so the archive
+     * stays readable) and std::runtime_error is thrown. Read errors are reported as std::system_error.
+     */
+    void add(const std::string &tar_name, int fd, size_t size, const TarFileOptions &options = TarFileOptions{})
+    {
+        if (!open_) return;
+
+        write_header(tar_name, size, options);
+        complete_entry(size, copy_content(fd, size, std::false_type{}));
+    }
+
+    /**
+     * Writer for the content of an entry started with begin_entry().
+     * The entry is closed by close() or, ignoring errors, by the destructor. The tar must not be used for anything
+     * else, nor moved, while an entry is open.
+     */
+    class EntryWriter
+    {
+    public:
+        EntryWriter(EntryWriter &&other) :
+            tar_{other.tar_},
+            mode_{other.mode_},
+            size_{other.size_},
+            written_{other.written_},
+            header_offset_{other.header_offset_},
+            name_(std::move(other.name_)),
+            options_(std::move(other.options_)),
+            spill_memory_(std::move(other.spill_memory_)),
+            spill_fd_{other.spill_fd_}
+        {
+            other.tar_ = nullptr;
+            other.spill_fd_ = -1;
+        }
+
+        EntryWriter(const EntryWriter &) = delete;
+        EntryWriter &operator=(const EntryWriter &) = delete;
+
+        ~EntryWriter()
+        {
+            if (tar_)
+            {
+                try
+                {
+                    close();
+                }
+                catch (...)
+                {
+                }
+            }
+            if (spill_fd_ >= 0)
+            {
+                ::close(spill_fd_);
+            }
+        }
+
+        /**
+         * Append content to the entry. Writing past the declared size, or past the spill limit of an entry of
+         * unknown size, throws std::length_error, and nothing is written.
+         */
+        void write(const char *data, size_t size)
+        {
+            if (!tar_)
+            {
+                throw std::logic_error("tarpp: cannot write to a closed entry");
+            }
+            if (size > size_ - written_)
+            {
+                throw std::length_error("tarpp: entry content exceeds its declared size");
+            }
+            if (mode_ == Mode::SPILLED)
+            {
+                spill(data, size);
+            }
+            else
+            {
+                tar_->write_data(data, size);
+            }
+            written_ += size;
+        }
+
+        void write(const std::string &content)
+        {
+            write(content.data(), content.size());
+        }
+
+        /**
+         * Number of bytes which can still be written to the entry.
+         */
+        size_t remaining() const { return size_ - written_; }
+
+        /**
+         * Close the entry and write its padding. If less than the declared size was written, the entry is completed
+         * with zeros (so the archive stays readable) and std::runtime_error is thrown.
+         * Entries of unknown size get their header patched, or are written from their spilled content.
+         */
+        void close()
+        {
+            if (!tar_) return;
+
+            auto tar = tar_;
+            tar_ = nullptr;
+            tar->entry_open_ = false;
+            switch (mode_)
+            {
+                case Mode::SIZED:
+                    tar->complete_entry(size_, written_);
+                    break;
+                case Mode::PATCHED:
+                    tar->write_padding(written_);
+                    tar->patch_header(header_offset_, name_, written_, options_);
+                    break;
+                case Mode::SPILLED:
+                    tar->write_spilled(name_, options_, spill_memory_, spill_fd_, written_);
+                    break;
+            }
+        }
+
+    private:
+        friend class BasicTar;
+
+        enum class Mode
+        {
+            SIZED,      // Size known up front
+            PATCHED,    // Size unknown, the header is patched on close
+            SPILLED     // Size unknown, the content is held back until close
+        };
+
+        EntryWriter(BasicTar &tar, Mode mode, size_t size, size_t header_offset, std::string name,
+                    TarFileOptions options) :
+            tar_{&tar},
+            mode_{mode},
+            size_{size},
+            written_{0},
+            header_offset_{header_offset},
+            name_(std::move(name)),
+            options_(std::move(options)),
+            spill_fd_{-1}
+        {}
+
+        /**
+         * Keep content in memory up to SPILL_MEMORY_SIZE bytes, then in a temporary file.
+         */
+        void spill(const char *data, size_t size)
+        {
+            using namespace details::constants;
+
+            if (spill_fd_ < 0)
+            {
+                auto length = std::min(size, SPILL_MEMORY_SIZE - spill_memory_.size());
+                spill_memory_.insert(spill_memory_.end(), data, data + length);
+                data += length;
+                size -= length;
+                if (size == 0) return;
+
+                spill_fd_ = io::make_temp_file();
+            }
+            io::write_all(spill_fd_, data, size);
+        }
+
+        BasicTar *tar_;
+        Mode mode_;
+        size_t size_;
+        size_t written_;
+        size_t header_offset_;
+        std::string name_;
+        TarFileOptions options_;
+        std::vector<char> spill_memory_;
+        int spill_fd_;
+    };
+
+    /**
+     * Start an entry of the given size whose content is then written incrementally with the returned writer.
+     */
+    EntryWriter begin_entry(const std::string &tar_name, size_t size, const TarFileOptions &options = TarFileOptions{})
+    {
+        if (!open_)
+        {
+            throw std::logic_error("tarpp: cannot add an entry to a finalized archive");
+        }
+
+        write_header(tar_name, size, options);
+        entry_open_ = true;
+        return EntryWriter{*this, EntryWriter::Mode::SIZED, size, 0, std::string{}, options};
+    }
+
+    /**
+     * Start an entry whose size is not known until its writer is closed.
+     * When the sink is seekable, a placeholder header is written and patched with the actual size on close.
+     * Otherwise the content is held back, in memory up to SPILL_MEMORY_SIZE bytes then in a temporary file
+     * limited to the spill limit, and the entry is written on close.
+     */
+    EntryWriter begin_entry(const std::string &tar_name, const TarFileOptions &options = TarFileOptions{})
+    {
+        if (!open_)
+        {
+            throw std::logic_error("tarpp: cannot add an entry to a finalized archive");
+        }
+
+        if (sink_seekable(details::has_patch<Sink>{}))
+        {
+            write_header(tar_name, 0, options);
+            auto header_offset = offset_ - details::constants::HEADER_SIZE;
+            entry_open_ = true;
+            return EntryWriter{*this, EntryWriter::Mode::PATCHED, std::numeric_limits<size_t>::max(), header_offset,
+                               tar_name, options};
+        }
+
+        check_no_open_entry();
+        entry_open_ = true;
+        return EntryWriter{*this, EntryWriter::Mode::SPILLED, spill_limit_, 0, tar_name, options};
+    }
+
+    /**
+     * Set the maximum size of entries of unknown size written to sinks which are not seekable.
+     */
+    void set_spill_limit(size_t limit) { spill_limit_ = limit; }
+
+    /**
+     * Enable deduplication for add() and queue(): regular entries whose content and attributes (mode, owner and
+     * modification time) are identical to those of an entry already added are added as links to it. Up to
+     * index_size bytes of content are kept to find them, the oldest being forgotten first. An index size of 0, the
+     * default, disables deduplication.
+     */
+    void set_dedup_index_size(size_t index_size) { dedup_.set_capacity(index_size); }
+
+    /**
+     * Add the content of the file at path. The size of the entry is the size of the file when it is opened.
+     * When the sink exposes a file descriptor (native_handle()) the content is copied by the kernel
+     * (copy_file_range or sendfile) without going through user space, when it can copy files itself (copy_from())
+     * it is handed the file; otherwise the file is streamed in fixed-size chunks.
+     * A file with several hard links which was already added is added as a link to its first entry, without content.
+     * Errors opening or reading the file are reported as std::system_error.
+     */
+    void add_file(const std::string &path, const std::string &tar_name, const TarFileOptions &options = TarFileOptions{})
+    {
+        if (!open_) return;
+
+        auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "tarpp: cannot open " + path);
+        }
+
+        try
+        {
+            struct stat st{};
+            if (::fstat(fd, &st) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "tarpp: cannot stat " + path);
+            }
+            auto size = static_cast<size_t>(st.st_size);
+
+            if (auto target = links_.find(st))
+            {
+                write_header(tar_name, 0, link_options(options, *target));
+            }
+            else
+            {
+                add_file(fd, tar_name, size, options);
+                links_.record(st, tar_name);
+            }
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+    }
+
+    /**
+     * Add an entry holding size bytes of the regular file open as fd, from its current position, copied like by
+     * add_file(). Unlike add() from a file descriptor, fd must support copy_file_range or sendfile when the sink can
+     * copy files.
+     */
+    void add_file(int fd, const std::string &tar_name, size_t size, const TarFileOptions &options = TarFileOptions{})
+    {
+        if (!open_) return;
+
+        write_header(tar_name, size, options);
+        complete_entry(size, copy_content(fd, size));
+    }
+
+    /**
+     * Add the file at path like add_file, without reading or writing its holes (as reported by
+     * lseek(SEEK_DATA/SEEK_HOLE)), as Format::sparse_encoding specifies:
+     * - PaxSparse (ustar and pax): in the pax GNU.sparse 1.0 format, a pax header giving the actual name and size,
+     *   then an entry holding the map of the data segments followed by the data.
+     * - GnuSparse: a GNU_SPARSE entry, with the map in its header and extension blocks, followed by the data.
+     * - NoSparse (V7): as by add_file, holes being read as zeros.
+     * A file without holes, such as an empty file, is added as by add_file.
+     */
+    void add_sparse_file(const std::string &path, const std::string &tar_name, const TarFileOptions &options = TarFileOptions{})
+    {
+        using namespace details::constants;
+
+        if (!open_) return;
+
+        auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "tarpp: cannot open " + path);
+        }
+
+        try
+        {
+            struct stat st{};
+            if (::fstat(fd, &st) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "tarpp: cannot stat " + path);
+            }
+            auto size = static_cast<size_t>(st.st_size);
+            auto segments = io::data_segments(fd, size);
+
+            // An empty file has no data segment, yet no hole either.
+            if (size == 0 ||
+                (segments.size() == 1 && segments.front().offset == 0 && segments.front().size == size))
+            {
+                seek(fd, 0);
+                write_header(tar_name, size, options);
+                complete_entry(size, copy_content(fd, size));
+            }
+            else
+            {
+                write_sparse_entry(fd, tar_name, size, segments, options);
+            }
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+    }
+
+    void finalize()
+    {
+        using namespace details::constants;
+        if (!open_) return;
+
+        check_no_open_entry();
+        open_ = false;
+        flush_queue();
+        write_zeros(BLOCK_SIZE * 2);
+        write_zeros((record_.size() - offset_ % record_.size()) % record_.size());
+        finish_sink(details::has_finish<Sink>{});
+    }
+
+    /**
+     * Finish the archive without the end-of-archive blocks, which leaves a segment: a sequence of entries that can
+     * be appended to another archive with append_segment(). The blocking factor should be 1, so that the segment is
+     * not padded.
+     */
+    void finalize_segment()
+    {
+        if (!open_) return;
+
+        check_no_open_entry();
+        open_ = false;
+        flush_queue();
+        if (record_used_ > 0)
+        {
+            sink_.write(record_.data(), record_used_);
+            record_used_ = 0;
+        }
+        finish_sink(details::has_finish<Sink>{});
+    }
+
+    /**
+     * Append size bytes of a segment, read from the current position of fd, to the archive. The content is copied
+     * by the kernel when the sink allows it.
+     * If fd does not provide the whole segment, the archive is completed with zeros and std::runtime_error is
+     * thrown.
+     */
+    void append_segment(int fd, size_t size)
+    {
+        using namespace details::constants;
+
+        if (!open_)
+        {
+            throw std::logic_error("tarpp: cannot add an entry to a finalized archive");
+        }
+        if (size % BLOCK_SIZE != 0)
+        {
+            throw std::invalid_argument("tarpp: segment size must be a multiple of the block size");
+        }
+
+        check_no_open_entry();
+        flush_queue();
+        complete_entry(size, copy_content(fd, size));
+    }
+
+private:
+    const std::string *find_duplicate(const std::string &content, const TarFileOptions &options) const
+    {
+        if (dedup_.capacity() == 0 || content.empty() || options.type() != FileType::REGULAR) return nullptr;
+        return dedup_.find(content, details::FileAttributes{options});
+    }
+
+    /**
+     * Entries whose name the format cannot store in full as a link name are not indexed: links to them would point
+     * to another name.
+     */
+    void index_content(const std::string &tar_name, const std::string &content, const TarFileOptions &options)
+    {
+        if (dedup_.capacity() == 0 || content.empty() || options.type() != FileType::REGULAR) return;
+        if (tar_name.size() > Format::max_linkname_size()) return;
+        dedup_.add(tar_name, content, details::FileAttributes{options});
+    }
+
+    void write_sparse_entry(int fd, const std::string &tar_name, size_t size, std::vector<io::DataSegment> segments,
+                            const TarFileOptions &options)
+    {
+        if (segments.empty() || segments.back().offset + static_cast<off_t>(segments.back().size) < static_cast<off_t>(size))
+        {
+            // The file ends with a hole: a last empty segment records where the file ends.
+            segments.push_back(io::DataSegment{static_cast<off_t>(size), 0});
+        }
+
+        write_sparse_entry(fd, tar_name, size, segments, options, typename Format::sparse_encoding{});
+    }
+
+    void write_sparse_entry(int fd, const std::string &tar_name, size_t size,
+                            const std::vector<io::DataSegment> &segments, const TarFileOptions &options,
+                            details::PaxSparse)
+    {
+        auto map = std::to_string(segments.size()) + "\n";
+        auto data_size = size_t{0};
+        for (const auto &segment : segments)
+        {
+            map += std::to_string(segment.offset) + "\n" + std::to_string(segment.size) + "\n";
+            data_size += segment.size;
+        }
+        map.append(details::padding_size(map.size()), '\0');
+
+        auto separator = tar_name.rfind('/');
+        auto directory = separator == std::string::npos ? std::string{"."} : tar_name.substr(0, separator);
+        auto base_name = separator == std::string::npos ? tar_name : tar_name.substr(separator + 1);
+
+        // The sparse records go in the same pax header as the ones the format needs for the entry, which readers
+        // would otherwise take as the only one. GNU.sparse.name comes last to override any path record.
+        auto entry_name = directory + "/GNUSparseFile.0/" + base_name;
+        auto entry_size = map.size() + data_size;
+        auto records = Format::pax_records(entry_name, entry_size, options) +
+                       details::pax_record("GNU.sparse.major", "1") +
+                       details::pax_record("GNU.sparse.minor", "0") +
+                       details::pax_record("GNU.sparse.name", tar_name) +
+                       details::pax_record("GNU.sparse.realsize", std::to_string(size));
+        write_header(entry_name, entry_size, options,
+                     details::extension_entry<Format>(directory + "/PaxHeaders.0/" + base_name,
+                                                      FileType::PAX_EXTENDED_HEADER, records));
+        write_data(map.data(), map.size());
+        complete_entry(entry_size, map.size() + copy_segments(fd, segments));
+    }
+
+    void write_sparse_entry(int fd, const std::string &tar_name, size_t,
+                            const std::vector<io::DataSegment> &segments, const TarFileOptions &options,
+                            details::GnuSparse)
+    {
+        using namespace details::constants;
+
+        auto data_size = size_t{0};
+        for (const auto &segment : segments)
+        {
+            data_size += segment.size;
+        }
+
+        auto sparse_options = options.with_type(FileType::GNU_SPARSE);
+        auto extension = Format::extension(tar_name, data_size, sparse_options);
+        check_no_open_entry();
+        flush_queue();
+
+        // The first segments are in the header, the others in extension blocks following it.
+        auto header = details::TarHeader{};
+        prototype_.format(header, tar_name, data_size, sparse_options);
+        auto extra_segments = segments.size() > GNU_SPARSE_HEADER_SEGMENTS ?
+                              segments.size() - GNU_SPARSE_HEADER_SEGMENTS : 0;
+        auto blocks = (extra_segments + GNU_SPARSE_BLOCK_SEGMENTS - 1) / GNU_SPARSE_BLOCK_SEGMENTS;
+        auto map = std::string(blocks * BLOCK_SIZE, '\0');
+        for (size_t i = 0; i < segments.size(); ++i)
+        {
+            auto field = i < GNU_SPARSE_HEADER_SEGMENTS ?
+                         header.data_ + GNU_SPARSE_OFFSET + i * 2 * GNU_SPARSE_FIELD_SIZE :
+                         &map[(i - GNU_SPARSE_HEADER_SEGMENTS) / GNU_SPARSE_BLOCK_SEGMENTS * BLOCK_SIZE +
+                              (i - GNU_SPARSE_HEADER_SEGMENTS) % GNU_SPARSE_BLOCK_SEGMENTS * 2 * GNU_SPARSE_FIELD_SIZE];
+            format_sparse_field(field, segments[i].offset);
+            format_sparse_field(field + GNU_SPARSE_FIELD_SIZE, segments[i].size);
+        }
+        for (size_t block = 0; block + 1 < blocks; ++block)
+        {
+            map[block * BLOCK_SIZE + GNU_SPARSE_BLOCK_IS_EXTENDED_OFFSET] = 1;
+        }
+        header.data_[GNU_SPARSE_IS_EXTENDED_OFFSET] = blocks > 0 ? 1 : 0;
+        format_sparse_field(header.data_ + GNU_SPARSE_REALSIZE_OFFSET,
+                            segments.back().offset + static_cast<off_t>(segments.back().size));
+        details::set_checksum(header);
+
+        write_data(extension.data(), extension.size());
+        write_data(header.data_, HEADER_SIZE);
+        write_data(map.data(), map.size());
+        complete_entry(data_size, copy_segments(fd, segments));
+    }
+
+    void write_sparse_entry(int fd, const std::string &tar_name, size_t size, const std::vector<io::DataSegment> &,
+                            const TarFileOptions &options, details::NoSparse)
+    {
+        seek(fd, 0);
+        write_header(tar_name, size, options);
+        complete_entry(size, copy_content(fd, size));
+    }
+
+    static void format_sparse_field(char *field, off_t value)
+    {
+        using namespace details::constants;
+        details::Base256Numbers::format(reinterpret_cast<char (&)[GNU_SPARSE_FIELD_SIZE]>(*field), value, true,
+                                        "sparse map");
+    }
+
+    /**
+     * Copy the data segments of the file fd.
+     * @return The number of bytes copied, less than the size of the segments if the file was truncated.
+     */
+    size_t copy_segments(int fd, const std::vector<io::DataSegment> &segments)
+    {
+        auto written = size_t{0};
+        for (const auto &segment : segments)
+        {
+            seek(fd, segment.offset);
+            auto copied = copy_content(fd, segment.size);
+            written += copied;
+            if (copied < segment.size) break;
+        }
+        return written;
+    }
+
+    static void seek(int fd, off_t offset)
+    {
+        if (::lseek(fd, offset, SEEK_SET) < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "tarpp: cannot seek file");
+        }
+    }
+
+    static TarFileOptions link_options(const TarFileOptions &options, const std::string &target)
+    {
+        return options.with_type(FileType::LINK).with_linkname(target);
+    }
+
+    struct QueuedEntry
+    {
+        std::string extension;
+        details::TarHeader header;
+        const char *content;
+        size_t size;
+    };
+
+    void add_content(const std::string &tar_name, const std::string &content, const TarFileOptions &options, std::true_type)
+    {
+        queue_content(tar_name, content, options, std::true_type{});
+        flush_queue();
+    }
+
+    void add_content(const std::string &tar_name, const std::string &content, const TarFileOptions &options, std::false_type)
+    {
+        write_header(tar_name, content.size(), options);
+        write_data(content.data(), content.size());
+        write_padding(content.size());
+    }
+
+    void queue_content(const std::string &tar_name, const std::string &content, const TarFileOptions &options, std::true_type)
+    {
+        using namespace details::constants;
+
+        auto header = details::TarHeader{};
+        prototype_.format(header, tar_name, content.size(), options);
+        queue_.push_back(QueuedEntry{Format::extension(tar_name, content.size(), options), header, content.data(),
+                                     content.size()});
+        if (queue_.size() >= MAX_QUEUED_ENTRIES)
+        {
+            flush_queue();
+        }
+    }
+
+    void queue_content(const std::string &tar_name, const std::string &content, const TarFileOptions &options, std::false_type)
+    {
+        add_content(tar_name, content, options, std::false_type{});
+    }
+
+    void write_queue(std::false_type)
+    {
+    }
+
+    void write_queue(std::true_type)
+    {
+        using namespace details::constants;
+        static const char zeros[BLOCK_SIZE] = {};
+
+        auto iov = std::vector<iovec>{};
+        iov.reserve(queue_.size() * 4 + 1);
+        auto total = size_t{0};
+        auto push = [&](const char *data, size_t size) {
+            iov.push_back(iovec{const_cast<char *>(data), size});
+            total += size;
+        };
+
+        auto pending = record_used_;
+        if (pending > 0)
+        {
+            push(record_.data(), pending);
+        }
+        for (const auto &entry : queue_)
+        {
+            if (!entry.extension.empty())
+            {
+                push(entry.extension.data(), entry.extension.size());
+            }
+            push(entry.header.data_, HEADER_SIZE);
+            push(entry.content, entry.size);
+            push(zeros, details::padding_size(entry.size));
+        }
+
+        offset_ += total - pending;
+
+        // Whole records go out in one writev, the rest is kept in the record buffer.
+        auto aligned = total - total % record_.size();
+        if (aligned == 0)
+        {
+            // Everything fits in the record in progress.
+            for (auto buffer = std::next(iov.begin(), pending > 0 ? 1 : 0); buffer != iov.end(); ++buffer)
+            {
+                buffer_data(static_cast<const char *>(buffer->iov_base), buffer->iov_len);
+            }
+            queue_.clear();
+            return;
+        }
+
+        auto split = iov.begin();
+        auto before_split = size_t{0};
+        while (split != iov.end() && before_split + split->iov_len <= aligned)
+        {
+            before_split += split->iov_len;
+            ++split;
+        }
+        auto tail = std::vector<iovec>(split, iov.end());
+        if (!tail.empty())
+        {
+            auto head_part = aligned - before_split;
+            tail.front().iov_base = static_cast<char *>(tail.front().iov_base) + head_part;
+            tail.front().iov_len -= head_part;
+            split->iov_len = head_part;
+            ++split;
+        }
+
+        sink_.writev(iov.data(), static_cast<size_t>(std::distance(iov.begin(), split)));
+        record_used_ = 0;
+        for (const auto &buffer : tail)
+        {
+            buffer_data(static_cast<const char *>(buffer.iov_base), buffer.iov_len);
+        }
+        queue_.clear();
+    }
+
+    /**
+     * Write size bytes of content read from the current position of fd.
+     * @return Number of bytes written, smaller than size only if fd reached end of file.
+     */
+    size_t copy_content(int fd, size_t size)
+    {
+        return copy_content(fd, size, details::can_copy_files<Sink>{});
+    }
+
+    /**
+     * Copy the file content out of the record buffer, keeping writes record-aligned: the record in progress is
+     * completed with a regular read, whole records are copied by the kernel or the sink and the remainder is read
+     * into the record buffer.
+     */
+    size_t copy_content(int fd, size_t size, std::true_type)
+    {
+        auto written = size_t{0};
+        if (record_used_ > 0)
+        {
+            written = read_into_record(fd, size);
+        }
+        if (written < size && record_used_ == 0)
+        {
+            auto direct = (size - written) - (size - written) % record_.size();
+            auto copied = copy_file(fd, direct, details::has_copy_from<Sink>{});
+            offset_ += copied;
+            written += copied;
+            if (copied == direct)
+            {
+                written += read_into_record(fd, size - written);
+            }
+        }
+        return written;
+    }
+
+    size_t copy_content(int fd, size_t size, std::false_type)
+    {
+        return stream_content(size, [fd](char *buffer, size_t length) {
+            return io::read_some(fd, buffer, length);
+        });
+    }
+
+    bool sink_seekable(std::true_type) const
+    {
+        return sink_.seekable();
+    }
+
+    bool sink_seekable(std::false_type) const
+    {
+        return false;
+    }
+
+    /**
+     * Rewrite the header at the given archive offset, wherever it is: still in the record buffer or already
+     * handed to the sink.
+     */
+    void patch_header(size_t header_offset, const std::string &tar_name, size_t size, const TarFileOptions &options)
+    {
+        using namespace details::constants;
+
+        if (Format::extension(tar_name, size, options).size() != Format::extension(tar_name, 0, options).size())
+        {
+            throw std::length_error("tarpp: the size of the entry does not fit in its header");
+        }
+
+        auto header = details::TarHeader{};
+        prototype_.format(header, tar_name, size, options);
+
+        auto buffer_offset = offset_ - record_used_;
+        if (record_used_ > 0 && header_offset >= buffer_offset)
+        {
+            std::memcpy(record_.data() + (header_offset - buffer_offset), header.data_, HEADER_SIZE);
+        }
+        else
+        {
+            patch_sink(header_offset, header.data_, HEADER_SIZE, details::has_patch<Sink>{});
+        }
+    }
+
+    void patch_sink(size_t offset, const char *data, size_t size, std::true_type)
+    {
+        sink_.patch(offset, data, size);
+    }
+
+    void patch_sink(size_t, const char *, size_t, std::false_type)
+    {
+    }
+
+    void write_spilled(const std::string &tar_name, const TarFileOptions &options, const std::vector<char> &memory,
+                       int spill_fd, size_t size)
+    {
+        write_header(tar_name, size, options);
+        write_data(memory.data(), memory.size());
+        auto written = memory.size();
+        if (spill_fd >= 0)
+        {
+            if (::lseek(spill_fd, 0, SEEK_SET) < 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "tarpp: cannot rewind temporary file");
+            }
+            written += copy_content(spill_fd, size - memory.size());
+        }
+        complete_entry(size, written);
+    }
+
+    size_t copy_file(int fd, size_t size, std::true_type)
+    {
+        return sink_.copy_from(fd, size);
+    }
+
+    size_t copy_file(int fd, size_t size, std::false_type)
+    {
+        return io::copy(fd, sink_.native_handle(), size);
+    }
+
+    void finish_sink(std::true_type)
+    {
+        sink_.finish();
+    }
+
+    void finish_sink(std::false_type)
+    {
+    }
+
+    void write_data(const char *data, size_t size)
+    {
+        offset_ += size;
+        emit_data(data, size, details::has_write_zeros<Sink>{});
+    }
+
+    void write_zeros(size_t size)
+    {
+        offset_ += size;
+        emit_zeros(size, details::has_write_zeros<Sink>{});
+    }
+
+    /**
+     * Sinks which can write zeros without being handed any data (such as memory-mapped files) get all writes
+     * directly: record alignment is irrelevant to them and buffering would only add a copy.
+     */
+    void emit_data(const char *data, size_t size, std::true_type)
+    {
+        sink_.write(data, size);
+    }
+
+    void emit_data(const char *data, size_t size, std::false_type)
+    {
+        buffer_data(data, size);
+    }
+
+    void emit_zeros(size_t size, std::true_type)
+    {
+        sink_.write_zeros(size);
+    }
+
+    void emit_zeros(size_t size, std::false_type)
+    {
+        buffer_zeros(size);
+    }
+
+    void flush_record()
+    {
+        sink_.write(record_.data(), record_.size());
+        record_used_ = 0;
+    }
+
+    /**
+     * Write through the record buffer. Whole records are handed to the sink without being copied when the buffer is
+     * empty.
+     */
+    void buffer_data(const char *data, size_t size)
+    {
+        if (record_used_ > 0)
+        {
+            auto length = std::min(size, record_.size() - record_used_);
+            std::memcpy(record_.data() + record_used_, data, length);
+            record_used_ += length;
+            if (record_used_ < record_.size()) return;
+
+            flush_record();
+            data += length;
+            size -= length;
+        }
+
+        auto direct = size - size % record_.size();
+        if (direct > 0)
+        {
+            sink_.write(data, direct);
+        }
+        std::memcpy(record_.data(), data + direct, size - direct);
+        record_used_ = size - direct;
+    }
+
+    void buffer_zeros(size_t size)
+    {
+        while (size > 0)
+        {
+            auto length = std::min(size, record_.size() - record_used_);
+            std::memset(record_.data() + record_used_, 0, length);
+            record_used_ += length;
+            size -= length;
+            if (record_used_ == record_.size())
+            {
+                flush_record();
+            }
+        }
+    }
+
+    /**
+     * Read at most size bytes from fd into the record buffer, stopping at the end of the current record.
+     * @return Number of bytes read, smaller than requested only if fd reached end of file.
+     */
+    size_t read_into_record(int fd, size_t size)
+    {
+        auto length = std::min(size, record_.size() - record_used_);
+        auto read = size_t{0};
+        while (read < length)
+        {
+            auto result = io::read_some(fd, record_.data() + record_used_ + read, length - read);
+            if (result == 0) break;
+            read += result;
+        }
+        record_used_ += read;
+        offset_ += read;
+        if (record_used_ == record_.size())
+        {
+            flush_record();
+        }
+        return read;
+    }
+
+    void check_no_open_entry() const
+    {
+        if (entry_open_)
+        {
+            throw std::logic_error("tarpp: an entry is still open");
+        }
+    }
+
+    void write_header(const std::string &tar_name, size_t size, const TarFileOptions &options)
+    {
+        write_header(tar_name, size, options, Format::extension(tar_name, size, options));
+    }
+
+    /**
+     * Write the header of an entry, preceded by the given extension entries.
+     */
+    void write_header(const std::string &tar_name, size_t size, const TarFileOptions &options,
+                      const std::string &extension)
+    {
+        using namespace details::constants;
+
+        check_no_open_entry();
+        flush_queue();
+
+        auto header = details::TarHeader{};
+        prototype_.format(header, tar_name, size, options);
+        write_data(extension.data(), extension.size());
+        write_data(header.data_, HEADER_SIZE);
+    }
+
+    void write_padding(size_t content_size)
+    {
+        write_zeros(details::padding_size(content_size));
+    }
+
+    /**
+     * Finish an entry of the given size of which only written bytes of content could be provided: the missing
+     * content is replaced by zeros so the archive stays readable, and std::runtime_error is thrown.
+     */
+    void complete_entry(size_t size, size_t written)
+    {
+        write_zeros(size - written);
+        write_padding(size);
+
+        if (written < size)
+        {
+            throw std::runtime_error("tarpp: entry content is shorter than its declared size");
+        }
+    }
+
+    /**
+     * Write an entry of the given size whose content is pulled from read_chunk(buffer, length), which returns the
+     * number of bytes it stored in buffer (0 at end of input).
+     */
+    template<typename ReadChunk>
+    void stream_entry(const std::string &tar_name, size_t size, const TarFileOptions &options, ReadChunk read_chunk)
+    {
+        write_header(tar_name, size, options);
+        complete_entry(size, stream_content(size, read_chunk));
+    }
+
+    /**
+     * Write at most size bytes of content pulled from read_chunk in fixed-size chunks.
+     * @return Number of bytes written, smaller than size only if read_chunk reached the end of its input.
+     */
+    template<typename ReadChunk>
+    size_t stream_content(size_t size, ReadChunk read_chunk)
+    {
+        using namespace details::constants;
+
+        auto buffer = std::vector<char>(std::min(size, (size_t)STREAM_CHUNK_SIZE));
+        auto written = size_t{0};
+        while (written < size)
+        {
+            auto read = read_chunk(buffer.data(), std::min(size - written, buffer.size()));
+            if (read == 0) break;
+            write_data(buffer.data(), read);
+            written += read;
+        }
+        return written;
+    }
+
+    Sink sink_;
+    bool open_;
+    bool entry_open_;
+    size_t spill_limit_;
+    std::vector<char> record_;
+    size_t record_used_;
+    size_t offset_;
+    std::vector<QueuedEntry> queue_;
+    std::vector<char> batch_;
+    details::HeaderPrototype<Format> prototype_;
+    details::HardLinks links_;
+    details::ContentIndex<details::FileAttributes> dedup_;
+};
+
+using Tar = BasicTar<sink::OStreamSink>;
+using FdTar = BasicTar<sink::FdSink>;
+
 } // tarpp
 
 #endif //TAR_TAR_H
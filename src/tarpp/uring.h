@@ -0,0 +1,670 @@
+#pragma once
+
+#ifndef TAR_URING_H
+#define TAR_URING_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "io.h"
+
+namespace tarpp {
+namespace io {
+
+/**
+ * Minimal io_uring submission/completion ring, driven through the raw system calls.
+ */
+class Uring
+{
+public:
+    explicit Uring(unsigned entries) :
+        fd_{-1},
+        sq_ring_{MAP_FAILED},
+        cq_ring_{MAP_FAILED},
+        sqes_{MAP_FAILED},
+        unsubmitted_{0}
+    {
+        io_uring_params params{};
+        fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (fd_ < 0)
+        {
+            details::throw_errno("tarpp: cannot set up io_uring");
+        }
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        auto single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap)
+        {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+
+        sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                          IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED) fail("tarpp: cannot map io_uring submission ring");
+        if (single_mmap)
+        {
+            cq_ring_ = sq_ring_;
+        }
+        else
+        {
+            cq_ring_ = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                              IORING_OFF_CQ_RING);
+            if (cq_ring_ == MAP_FAILED) fail("tarpp: cannot map io_uring completion ring");
+        }
+        sqes_ = ::mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+        if (sqes_ == MAP_FAILED) fail("tarpp: cannot map io_uring submission entries");
+
+        auto sq = static_cast<char *>(sq_ring_);
+        sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        sq_entries_ = params.sq_entries;
+
+        auto cq = static_cast<char *>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    }
+
+    Uring(const Uring &) = delete;
+    Uring &operator=(const Uring &) = delete;
+
+    ~Uring()
+    {
+        release();
+    }
+
+    /**
+     * Number of submission entries which can be obtained with get_sqe() before the ring is full.
+     */
+    unsigned sq_space() const
+    {
+        return sq_entries_ - (*sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE));
+    }
+
+    /**
+     * Get a zeroed submission entry, or nullptr if the submission ring is full.
+     * The entry is submitted by the next call to submit() or wait().
+     */
+    io_uring_sqe *get_sqe()
+    {
+        if (sq_space() == 0) return nullptr;
+
+        auto tail = *sq_tail_;
+        auto index = tail & sq_mask_;
+        auto sqe = static_cast<io_uring_sqe *>(sqes_) + index;
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        ++unsubmitted_;
+        return sqe;
+    }
+
+    /**
+     * Submit the pending entries without waiting for any completion.
+     */
+    void submit()
+    {
+        enter(0);
+    }
+
+    /**
+     * Submit the pending entries and wait until at least one completion is available.
+     */
+    void wait()
+    {
+        enter(1);
+    }
+
+    /**
+     * Call f(const io_uring_cqe &) for every available completion.
+     */
+    template<typename F>
+    void for_each_completion(F f)
+    {
+        auto head = *cq_head_;
+        auto tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            auto cqe = cqes_[head & cq_mask_];
+            ++head;
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            f(cqe);
+        }
+    }
+
+private:
+    void enter(unsigned min_complete)
+    {
+        while (true)
+        {
+            auto flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0u;
+            auto result = ::syscall(__NR_io_uring_enter, fd_, unsubmitted_, min_complete, flags, nullptr, 0);
+            if (result < 0)
+            {
+                if (errno == EINTR) continue;
+                details::throw_errno("tarpp: cannot submit to io_uring");
+            }
+            unsubmitted_ -= std::min(unsubmitted_, static_cast<unsigned>(result));
+            if (unsubmitted_ == 0 || min_complete > 0) return;
+        }
+    }
+
+    [[noreturn]] void fail(const char *what)
+    {
+        auto error = errno;
+        release();
+        errno = error;
+        details::throw_errno(what);
+    }
+
+    void release()
+    {
+        if (sqes_ != MAP_FAILED) ::munmap(sqes_, sq_entries_ * sizeof(io_uring_sqe));
+        if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) ::munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_ != MAP_FAILED) ::munmap(sq_ring_, sq_ring_size_);
+        if (fd_ >= 0) ::close(fd_);
+        sqes_ = cq_ring_ = sq_ring_ = MAP_FAILED;
+        fd_ = -1;
+    }
+
+    int fd_;
+    void *sq_ring_;
+    void *cq_ring_;
+    void *sqes_;
+    size_t sq_ring_size_;
+    size_t cq_ring_size_;
+
+    unsigned *sq_head_;
+    unsigned *sq_tail_;
+    unsigned sq_mask_;
+    unsigned *sq_array_;
+    unsigned sq_entries_;
+
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe *cqes_;
+
+    unsigned unsubmitted_;
+};
+
+} // io
+
+namespace sink {
+
+/**
+ * Sink writing to a seekable file descriptor with io_uring, keeping up to queue_depth buffers of I/O in flight.
+ *
+ * Small writes are gathered into buffers of buffer_size bytes, each submitted as an asynchronous write at its
+ * offset in the archive. Files added with BasicTar::add_file are copied with a linked read and write per buffer,
+ * so reads of the source files overlap with each other and with writes of the archive.
+ *
+ * I/O errors are reported by the next call to the sink, at the latest by finish(). A source file shorter than
+ * announced leaves zeros in the archive and makes finish() throw std::runtime_error.
+ * When io_uring is not available, the sink falls back to synchronous pread/pwrite.
+ * The file descriptor is not closed by the sink.
+ */
+class UringSink
+{
+public:
+    enum
+    {
+        DEFAULT_QUEUE_DEPTH = 32,
+        DEFAULT_BUFFER_SIZE = 128 * 1024
+    };
+
+    UringSink(int fd, unsigned queue_depth = DEFAULT_QUEUE_DEPTH, size_t buffer_size = DEFAULT_BUFFER_SIZE) :
+        fd_{fd},
+        buffer_size_{buffer_size},
+        start_{0},
+        offset_{0},
+        filling_{NONE},
+        filled_{0},
+        in_flight_{0}
+    {
+        if (queue_depth == 0 || buffer_size == 0)
+        {
+            throw std::invalid_argument("tarpp: io_uring queue depth and buffer size must be positive");
+        }
+
+        auto position = ::lseek(fd_, 0, SEEK_CUR);
+        if (position < 0)
+        {
+            io::details::throw_errno("tarpp: io_uring output must be seekable");
+        }
+        start_ = static_cast<size_t>(position);
+        offset_ = start_;
+
+        try
+        {
+            ring_.reset(new io::Uring{queue_depth * 2});
+        }
+        catch (const std::system_error &)
+        {
+            queue_depth = 1;
+        }
+
+        slots_.resize(queue_depth);
+        for (unsigned i = 0; i < queue_depth; ++i)
+        {
+            slots_[i].buffer.resize(buffer_size_);
+            free_.push_back(queue_depth - 1 - i);
+        }
+    }
+
+    UringSink(UringSink &&other) :
+        fd_{other.fd_},
+        buffer_size_{other.buffer_size_},
+        start_{other.start_},
+        offset_{other.offset_},
+        ring_(std::move(other.ring_)),
+        slots_(std::move(other.slots_)),
+        free_(std::move(other.free_)),
+        filling_{other.filling_},
+        filled_{other.filled_},
+        in_flight_{other.in_flight_},
+        sources_(std::move(other.sources_)),
+        error_(other.error_)
+    {
+        other.filling_ = NONE;
+        other.in_flight_ = 0;
+        other.sources_.clear();
+    }
+
+    UringSink(const UringSink &) = delete;
+    UringSink &operator=(const UringSink &) = delete;
+
+    ~UringSink()
+    {
+        try
+        {
+            drain();
+        }
+        catch (...)
+        {
+        }
+        for (const auto &source : sources_)
+        {
+            ::close(source.first);
+        }
+    }
+
+    /**
+     * Whether I/O goes through io_uring, rather than the synchronous fallback.
+     */
+    bool uses_uring() const { return static_cast<bool>(ring_); }
+
+    void write(const char *data, size_t size)
+    {
+        check_error();
+
+        while (size > 0)
+        {
+            if (filling_ == NONE)
+            {
+                filling_ = acquire_slot();
+                filled_ = 0;
+                slots_[filling_].archive_offset = offset_;
+            }
+
+            auto length = std::min(size, buffer_size_ - filled_);
+            std::memcpy(slots_[filling_].buffer.data() + filled_, data, length);
+            filled_ += length;
+            offset_ += length;
+            data += length;
+            size -= length;
+
+            if (filled_ == buffer_size_)
+            {
+                submit_filled();
+            }
+        }
+    }
+
+    /**
+     * Copy size bytes from the current position of fd into the archive, and move the position of fd past them.
+     * @return size, the bytes being scheduled; missing source bytes are reported by finish().
+     */
+    size_t copy_from(int fd, size_t size)
+    {
+        check_error();
+        submit_filled();
+
+        auto position = ::lseek(fd, 0, SEEK_CUR);
+        if (!ring_ || position < 0)
+        {
+            return copy_synchronously(fd, size);
+        }
+
+        // The source is duplicated so that it stays valid until its last read completes. It holds one more
+        // reference while reads are being scheduled, since earlier ones may complete in the meantime.
+        auto source = ::dup(fd);
+        if (source < 0)
+        {
+            io::details::throw_errno("tarpp: cannot duplicate source file descriptor");
+        }
+        sources_[source] = 1;
+
+        auto remaining = size;
+        auto source_offset = static_cast<size_t>(position);
+        while (remaining > 0)
+        {
+            auto index = acquire_slot();
+            auto length = std::min(remaining, buffer_size_);
+            auto &slot = slots_[index];
+            slot.archive_offset = offset_;
+            slot.length = length;
+            slot.source = source;
+
+            auto read = get_sqe_pair();
+            read->opcode = IORING_OP_READ;
+            read->fd = source;
+            read->addr = reinterpret_cast<uint64_t>(slot.buffer.data());
+            read->len = static_cast<uint32_t>(length);
+            read->off = source_offset;
+            read->flags = IOSQE_IO_LINK;
+            read->user_data = user_data(index, false);
+
+            prepare_write(ring_->get_sqe(), index);
+
+            slot.pending = 2;
+            in_flight_ += 2;
+            ++sources_[source];
+
+            offset_ += length;
+            source_offset += length;
+            remaining -= length;
+        }
+
+        ring_->submit();
+        if (--sources_[source] == 0)
+        {
+            sources_.erase(source);
+            ::close(source);
+        }
+
+        if (::lseek(fd, static_cast<off_t>(source_offset), SEEK_SET) < 0)
+        {
+            io::details::throw_errno("tarpp: cannot seek source file descriptor");
+        }
+        return size;
+    }
+
+    bool seekable() const
+    {
+        return true;
+    }
+
+    /**
+     * Overwrite bytes already written, once all the I/O in flight completed.
+     */
+    void patch(size_t offset, const char *data, size_t size)
+    {
+        drain();
+        check_error();
+        io::pwrite_all(fd_, data, size, static_cast<off_t>(start_ + offset));
+    }
+
+    /**
+     * Wait for all I/O to complete and report any error.
+     */
+    void finish()
+    {
+        drain();
+        check_error();
+    }
+
+private:
+    static constexpr unsigned NONE = ~0u;
+
+    struct Slot
+    {
+        std::vector<char> buffer;
+        size_t archive_offset = 0;
+        size_t length = 0;
+        int source = -1;
+        int pending = 0;
+        int64_t read_result = 0;
+        int64_t write_result = 0;
+    };
+
+    static uint64_t user_data(unsigned index, bool is_write)
+    {
+        return (static_cast<uint64_t>(index) << 1) | (is_write ? 1 : 0);
+    }
+
+    void check_error()
+    {
+        if (error_)
+        {
+            auto error = error_;
+            error_ = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    template<typename E>
+    void set_error(E error)
+    {
+        if (!error_)
+        {
+            error_ = std::make_exception_ptr(error);
+        }
+    }
+
+    unsigned acquire_slot()
+    {
+        while (free_.empty())
+        {
+            ring_->wait();
+            reap();
+        }
+        auto index = free_.back();
+        free_.pop_back();
+        return index;
+    }
+
+    io_uring_sqe *next_sqe()
+    {
+        auto sqe = ring_->get_sqe();
+        while (!sqe)
+        {
+            ring_->submit();
+            reap();
+            sqe = ring_->get_sqe();
+        }
+        return sqe;
+    }
+
+    /**
+     * Get the first of two consecutive submission entries, which must be submitted together to be linked.
+     */
+    io_uring_sqe *get_sqe_pair()
+    {
+        while (ring_->sq_space() < 2)
+        {
+            ring_->submit();
+            reap();
+        }
+        return ring_->get_sqe();
+    }
+
+    void prepare_write(io_uring_sqe *sqe, unsigned index)
+    {
+        const auto &slot = slots_[index];
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd_;
+        sqe->addr = reinterpret_cast<uint64_t>(slot.buffer.data());
+        sqe->len = static_cast<uint32_t>(slot.length);
+        sqe->off = slot.archive_offset;
+        sqe->user_data = user_data(index, true);
+    }
+
+    void submit_filled()
+    {
+        if (filling_ == NONE) return;
+
+        auto index = filling_;
+        filling_ = NONE;
+        auto &slot = slots_[index];
+        slot.length = filled_;
+        slot.source = -1;
+
+        if (!ring_)
+        {
+            write_synchronously(slot, slot.length);
+            free_.push_back(index);
+            return;
+        }
+
+        prepare_write(next_sqe(), index);
+        slot.pending = 1;
+        ++in_flight_;
+    }
+
+    void reap()
+    {
+        ring_->for_each_completion([this](const io_uring_cqe &cqe) {
+            auto index = static_cast<unsigned>(cqe.user_data >> 1);
+            auto &slot = slots_[index];
+            if (cqe.user_data & 1)
+            {
+                slot.write_result = cqe.res;
+            }
+            else
+            {
+                slot.read_result = cqe.res;
+            }
+            --in_flight_;
+            if (--slot.pending == 0)
+            {
+                complete(index);
+            }
+        });
+    }
+
+    /**
+     * Resolve a slot once all its I/O completed: failed linked reads and short writes are finished synchronously,
+     * so that the archive layout stays intact whatever happened.
+     */
+    void complete(unsigned index)
+    {
+        auto &slot = slots_[index];
+        try
+        {
+            if (slot.source >= 0 && slot.read_result != static_cast<int64_t>(slot.length))
+            {
+                auto read = static_cast<size_t>(std::max<int64_t>(slot.read_result, 0));
+                std::fill(slot.buffer.begin() + read, slot.buffer.begin() + slot.length, 0);
+                write_synchronously(slot, slot.length);
+                if (slot.read_result < 0)
+                {
+                    set_error(std::system_error(static_cast<int>(-slot.read_result), std::generic_category(),
+                                                "tarpp: cannot read source file"));
+                }
+                else
+                {
+                    set_error(std::runtime_error("tarpp: entry content is shorter than its declared size"));
+                }
+            }
+            else if (slot.write_result < 0)
+            {
+                set_error(std::system_error(static_cast<int>(-slot.write_result), std::generic_category(),
+                                            "tarpp: cannot write to file descriptor"));
+            }
+            else if (slot.write_result < static_cast<int64_t>(slot.length))
+            {
+                write_synchronously(slot, slot.length, static_cast<size_t>(slot.write_result));
+            }
+        }
+        catch (const std::system_error &error)
+        {
+            set_error(error);
+        }
+
+        if (slot.source >= 0 && --sources_[slot.source] == 0)
+        {
+            ::close(slot.source);
+            sources_.erase(slot.source);
+        }
+        slot.source = -1;
+        free_.push_back(index);
+    }
+
+    void write_synchronously(const Slot &slot, size_t length, size_t from = 0)
+    {
+        io::pwrite_all(fd_, slot.buffer.data() + from, length - from, static_cast<off_t>(slot.archive_offset + from));
+    }
+
+    size_t copy_synchronously(int fd, size_t size)
+    {
+        auto index = acquire_slot();
+        auto &slot = slots_[index];
+        auto copied = size_t{0};
+        try
+        {
+            while (copied < size)
+            {
+                auto read = io::read_some(fd, slot.buffer.data(), std::min(size - copied, buffer_size_));
+                if (read == 0) break;
+                slot.archive_offset = offset_;
+                write_synchronously(slot, read);
+                offset_ += read;
+                copied += read;
+            }
+        }
+        catch (...)
+        {
+            free_.push_back(index);
+            throw;
+        }
+        free_.push_back(index);
+        return copied;
+    }
+
+    void drain()
+    {
+        submit_filled();
+        if (!ring_) return;
+
+        while (in_flight_ > 0)
+        {
+            ring_->wait();
+            reap();
+        }
+    }
+
+    int fd_;
+    size_t buffer_size_;
+    size_t start_;
+    size_t offset_;
+    std::unique_ptr<io::Uring> ring_;
+    std::vector<Slot> slots_;
+    std::vector<unsigned> free_;
+    unsigned filling_;
+    size_t filled_;
+    unsigned in_flight_;
+    std::unordered_map<int, unsigned> sources_;
+    std::exception_ptr error_;
+};
+
+} // sink
+} // tarpp
+
+#endif //TAR_URING_H
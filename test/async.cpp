@@ -0,0 +1,136 @@
+#include "catch/catch.hpp"
+
+#include "tarpp/async.h"
+
+#ifdef TARPP_HAS_COROUTINES
+
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace tarpp;
+
+namespace {
+
+const auto BIG_CONTENT = std::string(100000, 'b');
+
+template<typename TarType>
+async::Task create_archive(TarType &tar)
+{
+    co_await tar.add_async("name", "content");
+    co_await tar.add_async("big", BIG_CONTENT);
+    co_await tar.finalize_async();
+}
+
+}
+
+TEST_CASE("Archives can be created by coroutines without blocking.", "[tar][async]")
+{
+    auto expected = std::stringstream{};
+    {
+        auto tar = Tar{expected};
+        tar.add("name", "content");
+        tar.add("big", BIG_CONTENT);
+    }
+
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    fcntl(fds[1], F_SETPIPE_SZ, 4096);
+
+    auto suspended = std::coroutine_handle<>{};
+    auto suspensions = 0;
+    auto tar = AsyncTar<sink::NonBlockingFdSink>{sink::NonBlockingFdSink{fds[1], [&](int, std::coroutine_handle<> handle) {
+        suspended = handle;
+        ++suspensions;
+    }}};
+
+    auto task = create_archive(tar);
+    task.start();
+
+    // A minimal event loop: the pipe becomes writable once it has been read from.
+    auto output = std::string{};
+    char buffer[4096];
+    while (!task.done())
+    {
+        REQUIRE(suspended);
+        auto length = read(fds[0], buffer, sizeof(buffer));
+        REQUIRE(length > 0);
+        output.append(buffer, static_cast<size_t>(length));
+        std::exchange(suspended, nullptr).resume();
+    }
+    task.rethrow();
+
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    ssize_t length;
+    while ((length = read(fds[0], buffer, sizeof(buffer))) > 0)
+    {
+        output.append(buffer, static_cast<size_t>(length));
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    REQUIRE(suspensions > 0);
+    REQUIRE(output == expected.str());
+    REQUIRE(tar.offset() == output.size());
+}
+
+TEST_CASE("Adding to a finalized async archive fails.", "[tar][async]")
+{
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    auto tar = AsyncTar<sink::NonBlockingFdSink>{sink::NonBlockingFdSink{fds[1], [](int, std::coroutine_handle<>) {}}};
+
+    auto finalize = tar.finalize_async();
+    finalize.start();
+    REQUIRE(finalize.done());
+
+    auto add = tar.add_async("name", "content");
+    add.start();
+    REQUIRE(add.done());
+    REQUIRE_THROWS_AS(add.rethrow(), const std::logic_error &);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST_CASE("Failed or abandoned async operations do not block the next ones.", "[tar][async]")
+{
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    fcntl(fds[1], F_SETPIPE_SZ, 4096);
+
+    SECTION("An operation whose task is destroyed while suspended.") {
+        auto tar = AsyncTar<sink::NonBlockingFdSink>{sink::NonBlockingFdSink{fds[1], [](int, std::coroutine_handle<>) {}}};
+        {
+            auto add = tar.add_async("big", BIG_CONTENT);
+            add.start();
+            REQUIRE(!add.done());
+        }
+
+        auto busy = tar.add_async("name", "content");
+        busy.start();
+        REQUIRE_NOTHROW(busy.rethrow());
+    }
+
+    SECTION("An operation whose write fails.") {
+        auto tar = AsyncTar<sink::NonBlockingFdSink>{sink::NonBlockingFdSink{fds[1], [](int, std::coroutine_handle<>) {}}};
+        close(fds[1]);
+        fds[1] = -1;
+
+        auto add = tar.add_async("name", "content");
+        add.start();
+        REQUIRE(add.done());
+        REQUIRE_THROWS_AS(add.rethrow(), const std::system_error &);
+
+        auto again = tar.add_async("name", "content");
+        again.start();
+        REQUIRE_THROWS_AS(again.rethrow(), const std::system_error &);
+    }
+
+    close(fds[0]);
+    if (fds[1] >= 0) close(fds[1]);
+}
+
+#endif
@@ -0,0 +1,77 @@
+#include "catch/catch.hpp"
+#include <random>
+#include <sstream>
+#include <string>
+
+#include "tarpp/tar.h"
+
+using namespace tarpp;
+
+namespace {
+
+std::string random_block(unsigned seed)
+{
+    auto engine = std::mt19937{seed};
+    auto block = std::string(details::constants::BLOCK_SIZE, '\0');
+    for (auto &c : block)
+    {
+        c = static_cast<char>(engine());
+    }
+    return block;
+}
+
+void check_kernel(details::checksum::Kernel kernel)
+{
+    for (auto seed = 0u; seed < 32; ++seed)
+    {
+        auto block = random_block(seed);
+        CHECK(kernel(block.data(), 0) == details::checksum::sum_portable(block.data(), 0));
+        CHECK(kernel(block.data(), 0x80) == details::checksum::sum_portable(block.data(), 0x80));
+    }
+    auto high = std::string(details::constants::BLOCK_SIZE, '\xff');
+    CHECK(kernel(high.data(), 0) == 255 * details::constants::BLOCK_SIZE);
+}
+
+}
+
+TEST_CASE("Signed and unsigned checksums sum the header bytes.", "[checksum]")
+{
+    auto block = std::string(details::constants::BLOCK_SIZE, ' ');
+    block[0] = '\xe9';
+    CHECK(details::unsigned_checksum(block.data()) == 511 * 32 + 0xe9);
+    CHECK(details::signed_checksum(block.data()) == 511 * 32 - 0x17);
+}
+
+TEST_CASE("Every checksum kernel supported by the CPU gives the same sums.", "[checksum]")
+{
+    check_kernel(details::checksum::sum_portable);
+    check_kernel(details::checksum::select_kernel());
+#ifdef TARPP_CHECKSUM_X86
+    if (__builtin_cpu_supports("sse2")) check_kernel(details::checksum::sum_sse2);
+    if (__builtin_cpu_supports("avx2")) check_kernel(details::checksum::sum_avx2);
+    if (__builtin_cpu_supports("avx512bw")) check_kernel(details::checksum::sum_avx512);
+#endif
+}
+
+TEST_CASE("Checksums of archived headers can be verified.", "[checksum]")
+{
+    auto out = std::stringstream{};
+    {
+        auto tar = Tar{out};
+        tar.add("caf\xc3\xa9", "content");
+    }
+    auto header = details::TarHeader{};
+    out.str().copy(header.data_, details::constants::HEADER_SIZE);
+    REQUIRE(details::verify_checksum(header));
+
+    SECTION("Headers checksummed with signed bytes are accepted.") {
+        std::fill(std::begin(header.header_.chksum_), std::end(header.header_.chksum_), ' ');
+        format::format_octal(header.header_.chksum_, details::signed_checksum(header.data_));
+        REQUIRE(details::verify_checksum(header));
+    }
+
+    SECTION("Corrupted headers are detected.") {
+        header.header_.name_[0] = 'C';
+        REQUIRE_FALSE(details::verify_checksum(header));
+    }
+}
@@ -0,0 +1,116 @@
+#include "catch/catch.hpp"
+#include <cstdlib>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "tarpp/concurrent.h"
+#include "helpers.h"
+
+using namespace tarpp;
+using namespace helpers;
+
+namespace {
+
+std::map<std::string, std::string> read_entries(const std::string &archive)
+{
+    using namespace details::constants;
+
+    auto entries = std::map<std::string, std::string>{};
+    auto offset = size_t{0};
+    while (offset + HEADER_SIZE <= archive.size() && archive[offset] != '\0')
+    {
+        auto header = archive.data() + offset;
+        auto size = std::strtoull(std::string(header + 124, 12).c_str(), nullptr, 8);
+        offset += HEADER_SIZE;
+        entries[header] = archive.substr(offset, size);
+        offset += size + details::padding_size(size);
+    }
+    return entries;
+}
+
+std::string entry_content(size_t thread, size_t entry)
+{
+    return std::string(100 * entry + thread, static_cast<char>('a' + thread));
+}
+
+}
+
+TEST_CASE("Entries can be added from several threads at once.", "[tar][concurrent]")
+{
+    constexpr size_t THREAD_COUNT = 4;
+    constexpr size_t ENTRY_COUNT = 50;
+
+    auto fd = io::make_temp_file();
+    {
+        ConcurrentTar tar{fd};
+        auto threads = std::vector<std::thread>{};
+        for (size_t thread = 0; thread < THREAD_COUNT; ++thread)
+        {
+            threads.emplace_back([&tar, thread] {
+                for (size_t entry = 0; entry < ENTRY_COUNT; ++entry)
+                {
+                    auto name = std::to_string(thread) + "/" + std::to_string(entry);
+                    tar.add(name, entry_content(thread, entry));
+                }
+            });
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    auto archive = read_fd(fd);
+    close(fd);
+
+    auto entries = read_entries(archive);
+    REQUIRE(entries.size() == THREAD_COUNT * ENTRY_COUNT);
+    for (size_t thread = 0; thread < THREAD_COUNT; ++thread)
+    {
+        for (size_t entry = 0; entry < ENTRY_COUNT; ++entry)
+        {
+            REQUIRE(entries[std::to_string(thread) + "/" + std::to_string(entry)] == entry_content(thread, entry));
+        }
+    }
+}
+
+TEST_CASE("A concurrent archive with one writer is a regular archive.", "[tar][concurrent]")
+{
+    auto input = io::make_temp_file();
+    auto file_content = std::string(10000, 'f');
+    io::write_all(input, file_content.data(), file_content.size());
+
+    auto expected = std::stringstream{};
+    {
+        auto tar = Tar{expected, details::constants::CLASSIC_BLOCKING_FACTOR};
+        tar.add("name", "content");
+        tar.add("file", file_content);
+    }
+
+    auto fd = io::make_temp_file();
+    {
+        ConcurrentTar tar{fd, details::constants::CLASSIC_BLOCKING_FACTOR};
+        tar.add("name", "content");
+        lseek(input, 0, SEEK_SET);
+        tar.add("file", input, file_content.size());
+        tar.finalize();
+        REQUIRE_THROWS_AS(tar.add("after", "content"), const std::logic_error &);
+    }
+    REQUIRE(read_fd(fd) == expected.str());
+
+    close(fd);
+    close(input);
+}
+
+TEST_CASE("A concurrent archive needs a seekable file descriptor.", "[tar][concurrent]")
+{
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    REQUIRE_THROWS_AS(ConcurrentTar{fds[1]}, const std::system_error &);
+    close(fds[0]);
+    close(fds[1]);
+}
@@ -0,0 +1,262 @@
+#include "catch/catch.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "tarpp/directory.h"
+
+using namespace tarpp;
+
+namespace {
+
+struct TempTree
+{
+    TempTree()
+    {
+        char name[] = "/tmp/tarpp-tree-XXXXXX";
+        root = mkdtemp(name);
+    }
+
+    ~TempTree()
+    {
+        auto command = "rm -rf " + root;
+        (void) system(command.c_str());
+    }
+
+    void file(const std::string &name, const std::string &content)
+    {
+        auto fd = open((root + "/" + name).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        REQUIRE(fd >= 0);
+        REQUIRE(write(fd, content.data(), content.size()) == (ssize_t)content.size());
+        close(fd);
+    }
+
+    void directory(const std::string &name)
+    {
+        REQUIRE(mkdir((root + "/" + name).c_str(), 0755) == 0);
+    }
+
+    void symlink(const std::string &name, const std::string &target)
+    {
+        REQUIRE(::symlink(target.c_str(), (root + "/" + name).c_str()) == 0);
+    }
+
+    std::string root;
+};
+
+struct ArchivedEntry
+{
+    std::string name;
+    char type;
+    std::string content;
+    std::string linkname;
+};
+
+std::vector<ArchivedEntry> list_entries(const std::string &archive)
+{
+    using namespace details::constants;
+
+    auto entries = std::vector<ArchivedEntry>{};
+    auto offset = size_t{0};
+    while (offset + HEADER_SIZE <= archive.size() && archive[offset] != '\0')
+    {
+        auto header = archive.data() + offset;
+        auto size = std::strtoull(std::string(header + 124, 12).c_str(), nullptr, 8);
+        offset += HEADER_SIZE;
+        entries.push_back(ArchivedEntry{header, header[156], archive.substr(offset, size), std::string(header + 157)});
+        offset += size + details::padding_size(size);
+    }
+    return entries;
+}
+
+/**
+ * Sink copying files itself, counting the bytes copied that way.
+ */
+struct CopyingSink
+{
+    void write(const char *data, size_t size)
+    {
+        out.append(data, size);
+    }
+
+    size_t copy_from(int fd, size_t size)
+    {
+        auto start = out.size();
+        out.resize(start + size);
+        auto read = io::read_at(fd, &out[start], size, lseek(fd, 0, SEEK_CUR));
+        lseek(fd, static_cast<off_t>(read), SEEK_CUR);
+        out.resize(start + read);
+        copied += read;
+        return read;
+    }
+
+    std::string out;
+    size_t copied = 0;
+};
+
+std::string archive(const std::string &root, size_t thread_count)
+{
+    auto out = std::stringstream{};
+    {
+        auto tar = Tar{out};
+        archive_directory(root, tar, thread_count);
+    }
+    return out.str();
+}
+
+}
+
+TEST_CASE("A directory tree can be archived in parallel.", "[tar][directory]")
+{
+    auto big = std::string(3 * 1024 * 1024, 'b');
+    auto tree = TempTree{};
+    tree.file("b", "content of b");
+    tree.file("a", big);
+    tree.directory("sub");
+    tree.file("sub/c", "content of c");
+    tree.directory("sub/empty");
+    tree.symlink("link", "b");
+    for (auto i = 0; i < 300; ++i)
+    {
+        tree.file("sub/file" + std::to_string(1000 + i), std::to_string(i));
+    }
+
+    auto output = archive(tree.root, 4);
+    auto entries = list_entries(output);
+
+    SECTION("Entries are sorted depth-first by name.") {
+        REQUIRE(entries.size() == 306);
+        REQUIRE(entries[0].name == "a");
+        REQUIRE(entries[1].name == "b");
+        REQUIRE(entries[2].name == "link");
+        REQUIRE(entries[3].name == "sub/");
+        REQUIRE(entries[4].name == "sub/c");
+        REQUIRE(entries[5].name == "sub/empty/");
+        REQUIRE(entries[6].name == "sub/file1000");
+        REQUIRE(entries[305].name == "sub/file1299");
+    }
+
+    SECTION("Entries have the type and content of the files.") {
+        REQUIRE(entries[0].content == big);
+        REQUIRE(entries[1].content == "content of b");
+        REQUIRE(entries[2].type == static_cast<char>(FileType::SIMLINK));
+        REQUIRE(entries[2].linkname == "b");
+        REQUIRE(entries[3].type == static_cast<char>(FileType::DIRECTORY));
+        REQUIRE(entries[3].content.empty());
+        REQUIRE(entries[305].content == "299");
+    }
+
+    SECTION("The archive does not depend on the number of threads.") {
+        REQUIRE(archive(tree.root, 1) == output);
+    }
+
+    SECTION("Large files copied by the kernel give the same archive as large files read in chunks.") {
+        char name[] = "/tmp/tarpp-test-XXXXXX";
+        auto fd = mkstemp(name);
+        unlink(name);
+        {
+            auto tar = FdTar{fd};
+            archive_directory(tree.root, tar, 3);
+        }
+        auto copied = std::string(output.size(), '\0');
+        REQUIRE(pread(fd, &copied[0], copied.size(), 0) == (ssize_t)output.size());
+        close(fd);
+        REQUIRE(copied == output);
+    }
+
+    SECTION("Large files are handed to sinks copying files themselves.") {
+        auto tar = BasicTar<CopyingSink>{CopyingSink{}};
+        archive_directory(tree.root, tar, 3);
+        tar.finalize();
+        REQUIRE(tar.sink().copied > big.size() / 2);
+        REQUIRE(tar.sink().out == output);
+    }
+}
+
+TEST_CASE("Hard links are archived once.", "[tar][directory][link]")
+{
+    auto tree = TempTree{};
+    tree.file("a", std::string(3 * 1024 * 1024, 'a'));
+    tree.file("b", "content of b");
+    tree.directory("sub");
+    REQUIRE(link((tree.root + "/a").c_str(), (tree.root + "/sub/a").c_str()) == 0);
+    REQUIRE(link((tree.root + "/b").c_str(), (tree.root + "/sub/b").c_str()) == 0);
+
+    auto entries = list_entries(archive(tree.root, 2));
+    REQUIRE(entries.size() == 5);
+    REQUIRE(entries[0].content.size() == 3 * 1024 * 1024);
+    REQUIRE(entries[1].content == "content of b");
+    REQUIRE(entries[3].name == "sub/a");
+    REQUIRE(entries[3].type == static_cast<char>(FileType::LINK));
+    REQUIRE(entries[3].linkname == "a");
+    REQUIRE(entries[3].content.empty());
+    REQUIRE(entries[4].type == static_cast<char>(FileType::LINK));
+    REQUIRE(entries[4].linkname == "b");
+}
+
+TEST_CASE("Hard links to files archived under a name too long for a link name keep their content.", "[tar][directory][link]")
+{
+    auto directory = std::string(60, 'd');
+    auto file = directory + "/" + std::string(60, 'f');
+    auto tree = TempTree{};
+    tree.directory(directory);
+    tree.file(file, "content");
+    REQUIRE(link((tree.root + "/" + file).c_str(), (tree.root + "/z").c_str()) == 0);
+
+    auto entries = list_entries(archive(tree.root, 2));
+    REQUIRE(entries.size() == 3);
+    REQUIRE(entries[2].name == "z");
+    REQUIRE(entries[2].type == static_cast<char>(FileType::REGULAR));
+    REQUIRE(entries[2].content == "content");
+}
+
+TEST_CASE("Device nodes are archived with their device numbers.", "[tar][directory][device]")
+{
+    auto tree = TempTree{};
+    if (mknod((tree.root + "/null").c_str(), S_IFCHR | 0666, makedev(1, 3)) != 0)
+    {
+        WARN("Device nodes cannot be created here.");
+        return;
+    }
+
+    auto output = archive(tree.root, 1);
+    REQUIRE(list_entries(output).size() == 1);
+    REQUIRE(output[156] == static_cast<char>(FileType::CHARACTER_SPECIAL_DEVICE));
+    REQUIRE(std::string(output.data() + 329, 8) == std::string("0000001\0", 8));
+    REQUIRE(std::string(output.data() + 337, 8) == std::string("0000003\0", 8));
+}
+
+TEST_CASE("Archiving a missing directory throws.", "[tar][directory]")
+{
+    auto out = std::stringstream{};
+    auto tar = Tar{out};
+    REQUIRE_THROWS_AS(archive_directory("/tmp/tarpp-missing-directory", tar, 2), const std::system_error &);
+}
+
+TEST_CASE("Tasks submitted by tasks are run.", "[tar][directory][scheduler]")
+{
+    std::atomic<int> count{0};
+    {
+        details::WorkStealingScheduler scheduler{3};
+        for (auto i = 0; i < 10; ++i)
+        {
+            scheduler.submit([&] {
+                for (auto j = 0; j < 10; ++j)
+                {
+                    scheduler.submit([&] { ++count; });
+                }
+            });
+        }
+        while (count < 100)
+        {
+            std::this_thread::yield();
+        }
+    }
+    REQUIRE(count == 100);
+}
@@ -1,15 +1,10 @@
 #include <catch/catch.hpp>
 #include <tarpp/tar.h>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
-
-TEST_CASE("Octal format string are generated correctly.", "[format]")
-{
-    using namespace tarpp::format;
-
-    REQUIRE(details::octal_format_string_t<7>::value == std::string{"%07o"});
-    REQUIRE(details::octal_format_string_t<15>::value == std::string{"%015o"});
-    REQUIRE(details::octal_format_string_t<1234>::value == std::string{"%01234o"});
-}
+#include <iostream>
 
 TEST_CASE("Octal values are formatted correctly.", "[format]")
 {
@@ -90,4 +85,127 @@ TEST_CASE("Strings with optional null termination are formatted correctly.", "[f
         REQUIRE(std::equal(std::begin(buffer), std::end(buffer), data.begin()));
         REQUIRE(buffer[BUFFER_SIZE - 1] != '\0');
     }
-}
\ No newline at end of file
+}
+
+TEST_CASE("Octal values are formatted like snprintf would.", "[format]")
+{
+    using namespace tarpp::format;
+
+    for (auto value : {0u, 1u, 7u, 0777u, 01234567u, 07777777u, 010000000u, 0xffffffffu})
+    {
+        char buffer[8];
+        char expected[8];
+        auto result = format_octal(buffer, value);
+        CHECK(result == snprintf(expected, sizeof(expected), "%07o", value));
+        CHECK(std::string{buffer} == std::string{expected});
+    }
+}
+
+TEST_CASE("Octal values wider than 32 bits are formatted completely.", "[format]")
+{
+    using namespace tarpp::format;
+
+    SECTION ("Large sizes fit a 12 bytes field.") {
+        char buffer[12];
+        auto result = format_octal(buffer, uint64_t{8589934591});
+        CHECK(result == 11);
+        CHECK(buffer == std::string{"77777777777"});
+    }
+
+    SECTION ("The largest 64-bit value.") {
+        char buffer[23];
+        auto result = format_octal(buffer, UINT64_MAX);
+        CHECK(result == 22);
+        CHECK(buffer == std::string{"1777777777777777777777"});
+    }
+
+    SECTION ("Negative values are formatted as their unsigned counterpart.") {
+        char buffer[12];
+        auto result = format_octal(buffer, int64_t{-1});
+        CHECK(result == 22);
+        CHECK(buffer == std::string{"17777777777"});
+    }
+}
+
+TEST_CASE("Strings are formatted correctly.", "[format]")
+{
+    using namespace tarpp::format;
+
+    char buffer[4];
+    SECTION ("Short strings are copied and null-terminated.") {
+        CHECK(format_string(buffer, "ab") == 2);
+        CHECK(buffer == std::string{"ab"});
+    }
+
+    SECTION ("Long strings are truncated.") {
+        CHECK(format_string(buffer, std::string{"abcdef"}) == 6);
+        CHECK(buffer == std::string{"abc"});
+    }
+}
+
+TEST_CASE("Numbers are formatted in base-256.", "[format]")
+{
+    using namespace tarpp::format;
+
+    SECTION ("Sizes over 8 GiB.") {
+        char buffer[12];
+        REQUIRE(format_base256(buffer, uint64_t{1} << 36));
+        auto expected = std::string{"\x80\0\0\0\0\0\0\x10\0\0\0\0", 12};
+        CHECK(std::string(buffer, sizeof(buffer)) == expected);
+    }
+
+    SECTION ("Negative values.") {
+        char buffer[12];
+        REQUIRE(format_base256(buffer, int64_t{-2}));
+        auto expected = std::string(11, '\xff') + '\xfe';
+        CHECK(std::string(buffer, sizeof(buffer)) == expected);
+    }
+
+    SECTION ("Values which do not fit are rejected.") {
+        char buffer[8] = {};
+        CHECK(format_base256(buffer, uint64_t{1} << 62));
+        CHECK_FALSE(format_base256(buffer, uint64_t{1} << 63));
+        char small[2] = {};
+        CHECK(format_base256(small, 0x7fff));
+        CHECK_FALSE(format_base256(small, 0x8000));
+        CHECK(format_base256(small, -0x8000));
+        CHECK_FALSE(format_base256(small, -0x8001));
+    }
+}
+
+namespace {
+
+template<typename Format>
+double time_per_call(Format format)
+{
+    const auto iterations = 10000000;
+    auto start = std::chrono::steady_clock::now();
+    for (auto i = 0; i < iterations; ++i)
+    {
+        format(static_cast<unsigned>(i));
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+}
+
+TEST_CASE("Benchmark octal formatting against snprintf.", "[.][format][benchmark]")
+{
+    using namespace tarpp::format;
+
+    char buffer[12];
+    auto checksum = 0u;
+    auto with_snprintf = time_per_call([&](unsigned value) {
+        snprintf(buffer, sizeof(buffer), "%011o", value);
+        checksum += static_cast<unsigned char>(buffer[10]);
+    });
+    auto with_encoder = time_per_call([&](unsigned value) {
+        format_octal(buffer, value);
+        checksum += static_cast<unsigned char>(buffer[10]);
+    });
+
+    std::cout << "snprintf: " << with_snprintf << " ns, format_octal: " << with_encoder << " ns (" << checksum
+              << ")" << std::endl;
+    CHECK(with_encoder < with_snprintf);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#ifndef TARPP_TEST_HELPERS_H
+#define TARPP_TEST_HELPERS_H
+
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <unistd.h>
+
+/**
+ * Helpers shared by the test files.
+ */
+namespace helpers {
+
+/**
+ * A temporary file, open for reading and writing, removed on destruction.
+ */
+struct TempFile
+{
+    TempFile()
+    {
+        char name[] = "/tmp/tarpp-test-XXXXXX";
+        fd = mkstemp(name);
+        path = name;
+    }
+
+    ~TempFile()
+    {
+        close(fd);
+        unlink(path.c_str());
+    }
+
+    std::string path;
+    int fd;
+};
+
+/**
+ * Read fd until end of file, from its start if it is seekable (files), from its current position otherwise (pipes).
+ */
+inline std::string read_fd(int fd)
+{
+    auto result = std::string{};
+    char buffer[4096];
+    lseek(fd, 0, SEEK_SET);
+    ssize_t read_size;
+    while ((read_size = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        result.append(buffer, static_cast<size_t>(read_size));
+    }
+    return result;
+}
+
+/**
+ * Content of the file at path, empty if it cannot be read.
+ */
+inline std::string read_path(const std::string &path)
+{
+    auto in = std::ifstream{path, std::ios::binary};
+    return std::string{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+}
+
+} // helpers
+
+#endif //TARPP_TEST_HELPERS_H
@@ -0,0 +1,93 @@
+#include "catch/catch.hpp"
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "tarpp/pipeline.h"
+
+using namespace tarpp;
+
+namespace {
+
+template<typename TarType>
+void add_entries(TarType &tar)
+{
+    for (auto i = 0; i < 20; ++i)
+    {
+        tar.add("entry" + std::to_string(i), std::string(777 * i, static_cast<char>('a' + i)));
+    }
+}
+
+std::string reference_archive(size_t blocking_factor)
+{
+    auto out = std::stringstream{};
+    {
+        auto tar = Tar{out, blocking_factor};
+        add_entries(tar);
+    }
+    return out.str();
+}
+
+}
+
+TEST_CASE("Archives can be written by an I/O thread.", "[tar][pipeline]")
+{
+    SECTION("With a ring larger than the archive.") {
+        auto out = std::stringstream{};
+        {
+            auto tar = PipelinedTar<sink::OStreamSink>{sink::PipelinedSink<sink::OStreamSink>{out}};
+            add_entries(tar);
+        }
+        REQUIRE(out.str() == reference_archive(1));
+    }
+
+    SECTION("With a small ring and a slow sink.") {
+        auto out = std::string{};
+        auto slow = sink::make_callback_sink([&out](const char *data, size_t size) {
+            std::this_thread::yield();
+            out.append(data, size);
+        });
+        {
+            auto tar = PipelinedTar<decltype(slow)>{sink::PipelinedSink<decltype(slow)>{slow, 1024},
+                                                    details::constants::CLASSIC_BLOCKING_FACTOR};
+            add_entries(tar);
+        }
+        REQUIRE(out == reference_archive(details::constants::CLASSIC_BLOCKING_FACTOR));
+    }
+
+    SECTION("With both threads repeatedly sleeping.") {
+        // The producer sleeps on a full ring while the sink stalls, then the I/O thread sleeps on the drained ring
+        // while the producer stalls: no wakeup must be lost.
+        auto out = std::string{};
+        auto writes = 0;
+        auto stalling = sink::make_callback_sink([&out, &writes](const char *data, size_t size) {
+            if (++writes % 3 == 0) std::this_thread::sleep_for(std::chrono::microseconds{200});
+            out.append(data, size);
+        });
+        auto expected = std::stringstream{};
+        {
+            auto tar = PipelinedTar<decltype(stalling)>{sink::PipelinedSink<decltype(stalling)>{stalling, 512}, 1};
+            auto reference = Tar{expected, 1};
+            for (auto i = 0; i < 300; ++i)
+            {
+                auto content = std::string(100 * (i % 7), static_cast<char>('a' + i % 26));
+                tar.add("entry" + std::to_string(i), content);
+                reference.add("entry" + std::to_string(i), content);
+                if (i % 5 == 0) std::this_thread::sleep_for(std::chrono::microseconds{100});
+            }
+        }
+        REQUIRE(out == expected.str());
+    }
+}
+
+TEST_CASE("Errors of the I/O thread are reported.", "[tar][pipeline]")
+{
+    auto failing = sink::make_callback_sink([](const char *, size_t) {
+        throw std::runtime_error("failed");
+    });
+    auto tar = PipelinedTar<decltype(failing)>{sink::PipelinedSink<decltype(failing)>{failing, 1024}};
+    REQUIRE_THROWS_AS(add_entries(tar), const std::runtime_error &);
+    REQUIRE_THROWS_AS(tar.finalize(), const std::runtime_error &);
+}
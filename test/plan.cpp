@@ -0,0 +1,131 @@
+#include "catch/catch.hpp"
+#include <sstream>
+
+#include "tarpp/plan.h"
+
+using namespace tarpp;
+
+namespace {
+
+void require_plan_matches_archive(size_t blocking_factor)
+{
+    using namespace details::constants;
+
+    auto entries = std::vector<TarEntry>{
+        {"first", "content", TarFileOptions{}},
+        {"empty", "", TarFileOptions{}},
+        {"big", std::string(30000, 'b'), TarFileOptions{}},
+        {"block", std::string(BLOCK_SIZE, 'x'), TarFileOptions{}}
+    };
+
+    auto planner = ArchivePlanner{blocking_factor};
+    auto out = std::stringstream{};
+    {
+        auto tar = Tar{out, blocking_factor};
+        for (const auto &entry : entries)
+        {
+            planner.add(entry.name, entry.content, entry.options);
+            tar.add(entry.name, entry.content, entry.options);
+        }
+    }
+    auto result = out.str();
+
+    REQUIRE(planner.size() == result.size());
+
+    REQUIRE(planner.entries().size() == entries.size());
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const auto &plan = planner.entries()[i];
+        REQUIRE(plan.size == entries[i].content.size());
+        REQUIRE(plan.content_offset == plan.header_offset + HEADER_SIZE);
+        REQUIRE(result.compare(plan.header_offset, entries[i].name.size(), entries[i].name) == 0);
+        REQUIRE(result.compare(plan.content_offset, plan.size, entries[i].content) == 0);
+    }
+}
+
+}
+
+TEST_CASE("The plan matches the archive.", "[plan]")
+{
+    SECTION("One block per record.") {
+        require_plan_matches_archive(1);
+    }
+
+    SECTION("Classic blocking factor.") {
+        require_plan_matches_archive(details::constants::CLASSIC_BLOCKING_FACTOR);
+    }
+}
+
+TEST_CASE("Batches can be planned.", "[plan]")
+{
+    auto entries = std::vector<TarEntry>{
+        {"first", "content", TarFileOptions{}},
+        {"second", std::string(1000, 's'), TarFileOptions{}}
+    };
+
+    auto planner = ArchivePlanner{};
+    planner.add_batch(entries);
+    REQUIRE(planner.entries().size() == 2);
+    REQUIRE(planner.content_size() == 5 * details::constants::BLOCK_SIZE);
+    REQUIRE(planner.size() == 7 * details::constants::BLOCK_SIZE);
+}
+
+TEST_CASE("Planned entries stay valid when more entries are planned.", "[plan]")
+{
+    auto planner = ArchivePlanner{};
+    const auto &first = planner.add("first", std::string(1000, 'f'));
+    for (auto i = 0; i < 100; ++i)
+    {
+        planner.add("entry" + std::to_string(i), "content");
+    }
+    REQUIRE(first.header_offset == 0);
+    REQUIRE(first.content_offset == details::constants::HEADER_SIZE);
+    REQUIRE(first.size == 1000);
+}
+
+TEST_CASE("The plan follows the entries written before long names.", "[plan][format]")
+{
+    auto options = TarFileOptions{};
+    auto entries = std::vector<TarEntry>{
+        {"short", "content", options},
+        {std::string(150, 'l'), "long name", options},
+        {"link", "", options.with_type(FileType::SIMLINK).with_linkname(std::string(300, 't'))},
+        {"after", "content", options}
+    };
+
+    auto check = [&](std::string result, const std::vector<EntryPlan> &plans, size_t size) {
+        REQUIRE(size == result.size());
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            REQUIRE(result.compare(plans[i].content_offset, plans[i].size, entries[i].content) == 0);
+        }
+        REQUIRE(plans[1].content_offset > plans[1].header_offset + details::constants::HEADER_SIZE);
+        REQUIRE(plans[2].content_offset > plans[2].header_offset + details::constants::HEADER_SIZE);
+        REQUIRE(plans[3].content_offset == plans[3].header_offset + details::constants::HEADER_SIZE);
+    };
+
+    SECTION("GNU long names.") {
+        auto planner = BasicArchivePlanner<GnuFormat>{};
+        planner.add_batch(entries);
+        auto out = std::stringstream{};
+        {
+            auto tar = BasicTar<sink::OStreamSink, GnuFormat>{out};
+            tar.add_batch(entries);
+        }
+        check(out.str(), planner.entries(), planner.size());
+    }
+
+    SECTION("Pax records.") {
+        auto planner = BasicArchivePlanner<PaxFormat>{};
+        planner.add_batch(entries);
+        auto out = std::stringstream{};
+        {
+            auto tar = BasicTar<sink::OStreamSink, PaxFormat>{out};
+            for (const auto &entry : entries)
+            {
+                tar.add(entry.name, entry.content, entry.options);
+            }
+        }
+        check(out.str(), planner.entries(), planner.size());
+    }
+}
@@ -0,0 +1,115 @@
+#include "catch/catch.hpp"
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+#include "tarpp/segment.h"
+#include "helpers.h"
+
+using namespace tarpp;
+using namespace helpers;
+
+namespace {
+
+std::string entry_name(size_t segment, size_t entry)
+{
+    return "segment" + std::to_string(segment) + "/entry" + std::to_string(entry);
+}
+
+std::string entry_content(size_t segment, size_t entry)
+{
+    return std::string(1000 * entry + segment, static_cast<char>('a' + segment));
+}
+
+template<typename TarType>
+void add_entries(size_t segment, TarType &tar)
+{
+    for (size_t entry = 0; entry < 5; ++entry)
+    {
+        tar.add(entry_name(segment, entry), entry_content(segment, entry));
+    }
+}
+
+std::string reference_archive(size_t segment_count, size_t blocking_factor)
+{
+    auto out = std::stringstream{};
+    {
+        auto tar = Tar{out, blocking_factor};
+        for (size_t segment = 0; segment < segment_count; ++segment)
+        {
+            add_entries(segment, tar);
+        }
+    }
+    return out.str();
+}
+
+}
+
+TEST_CASE("Segments can be appended to an archive.", "[tar][segment]")
+{
+    auto segment = std::stringstream{};
+    {
+        auto tar = Tar{segment};
+        add_entries(1, tar);
+        tar.finalize_segment();
+    }
+    auto segment_content = segment.str();
+    REQUIRE(segment_content.size() % details::constants::BLOCK_SIZE == 0);
+
+    auto segment_fd = io::make_temp_file();
+    io::write_all(segment_fd, segment_content.data(), segment_content.size());
+
+    auto build = [&](Tar &tar) {
+        add_entries(0, tar);
+        lseek(segment_fd, 0, SEEK_SET);
+        tar.append_segment(segment_fd, segment_content.size());
+        tar.finalize();
+    };
+
+    SECTION("With a blocking factor of 1.") {
+        auto out = std::stringstream{};
+        auto tar = Tar{out};
+        build(tar);
+        REQUIRE(out.str() == reference_archive(2, 1));
+    }
+
+    SECTION("With the classic blocking factor.") {
+        auto out = std::stringstream{};
+        auto tar = Tar{out, details::constants::CLASSIC_BLOCKING_FACTOR};
+        build(tar);
+        REQUIRE(out.str() == reference_archive(2, details::constants::CLASSIC_BLOCKING_FACTOR));
+    }
+
+    SECTION("A partial block is rejected.") {
+        auto out = std::stringstream{};
+        auto tar = Tar{out};
+        REQUIRE_THROWS_AS(tar.append_segment(segment_fd, 100), const std::invalid_argument &);
+    }
+
+    close(segment_fd);
+}
+
+TEST_CASE("Segments can be built in parallel.", "[tar][segment]")
+{
+    auto output_fd = io::make_temp_file();
+    {
+        auto tar = FdTar{output_fd, details::constants::CLASSIC_BLOCKING_FACTOR};
+        archive_segments(tar, 4, [](size_t segment, FdTar &segment_tar) {
+            add_entries(segment, segment_tar);
+        });
+    }
+    REQUIRE(read_fd(output_fd) == reference_archive(4, details::constants::CLASSIC_BLOCKING_FACTOR));
+    close(output_fd);
+}
+
+TEST_CASE("Errors building a segment are rethrown.", "[tar][segment]")
+{
+    auto out = std::stringstream{};
+    auto tar = Tar{out};
+    auto build = [](size_t segment, FdTar &) {
+        if (segment == 2) throw std::runtime_error("failed");
+    };
+    REQUIRE_THROWS_AS(archive_segments(tar, 3, build), const std::runtime_error &);
+    REQUIRE(out.str().empty());
+}
@@ -0,0 +1,250 @@
+#include "catch/catch.hpp"
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
+#include "tarpp/plan.h"
+#include "tarpp/tar.h"
+
+using namespace tarpp;
+
+namespace {
+
+std::string reference_tar()
+{
+    auto out = std::stringstream{};
+    {
+        auto tar = Tar{out};
+        tar.add("name", "content");
+        tar.add("other", std::string(1000, 'o'));
+    }
+    return out.str();
+}
+
+template<typename Sink>
+void add_reference_content(BasicTar<Sink> &tar)
+{
+    tar.add("name", "content");
+    tar.add("other", std::string(1000, 'o'));
+    tar.finalize();
+}
+
+}
+
+TEST_CASE("A tar can be written to a contiguous buffer.", "[tar][sink]")
+{
+    auto buffer = std::vector<char>{};
+    auto tar = BasicTar<sink::BufferSink>{buffer};
+    add_reference_content(tar);
+
+    REQUIRE(std::string(buffer.begin(), buffer.end()) == reference_tar());
+}
+
+TEST_CASE("A tar can be written to a callback.", "[tar][sink]")
+{
+    auto result = std::string{};
+    auto callback = sink::make_callback_sink([&result](const char *data, size_t size) { result.append(data, size); });
+    auto tar = BasicTar<decltype(callback)>{callback};
+    add_reference_content(tar);
+
+    REQUIRE(result == reference_tar());
+}
+
+TEST_CASE("Only sinks exposing a file descriptor are used for kernel copies.", "[tar][sink]")
+{
+    REQUIRE(details::has_native_handle<sink::FdSink>::value);
+    REQUIRE_FALSE(details::has_native_handle<sink::OStreamSink>::value);
+    REQUIRE_FALSE(details::has_native_handle<sink::BufferSink>::value);
+}
+
+namespace {
+
+/**
+ * Sink keeping track of the number of calls made to write and writev.
+ */
+struct CountingSink
+{
+    void write(const char *data, size_t size)
+    {
+        ++writes;
+        output->append(data, size);
+    }
+
+    void writev(iovec *iov, size_t count)
+    {
+        ++gathered_writes;
+        for (size_t i = 0; i < count; ++i)
+        {
+            output->append(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+        }
+    }
+
+    std::string *output;
+    int writes;
+    int gathered_writes;
+};
+
+}
+
+TEST_CASE("Sinks supporting writev receive whole entries in one call.", "[tar][sink][writev]")
+{
+    auto result = std::string{};
+    auto tar = BasicTar<CountingSink>{CountingSink{&result, 0, 0}};
+
+    SECTION("Each added entry is a single gathered write.") {
+        tar.add("name", "content");
+        tar.add("other", std::string(1000, 'o'));
+        REQUIRE(tar.sink().writes == 0);
+        REQUIRE(tar.sink().gathered_writes == 2);
+
+        tar.finalize();
+        REQUIRE(result == reference_tar());
+    }
+
+    SECTION("Queued entries are written together.") {
+        auto first = std::string{"content"};
+        auto second = std::string(1000, 'o');
+        tar.queue("name", first);
+        tar.queue("other", second);
+        REQUIRE(tar.sink().gathered_writes == 0);
+
+        tar.flush_queue();
+        REQUIRE(tar.sink().writes == 0);
+        REQUIRE(tar.sink().gathered_writes == 1);
+
+        tar.finalize();
+        REQUIRE(result == reference_tar());
+    }
+}
+
+TEST_CASE("Gathered writes keep the archive record-aligned.", "[tar][sink][writev][record]")
+{
+    using namespace details::constants;
+
+    auto result = std::string{};
+    auto tar = BasicTar<CountingSink>{CountingSink{&result, 0, 0}, CLASSIC_BLOCKING_FACTOR};
+    auto contents = std::vector<std::string>{};
+    for (int i = 0; i < 100; ++i)
+    {
+        contents.push_back(std::string(static_cast<size_t>(i * 37), 'c'));
+    }
+    for (const auto &content : contents)
+    {
+        tar.queue("name", content);
+    }
+    tar.finalize();
+
+    auto expected = std::stringstream{};
+    {
+        auto reference = Tar{expected, CLASSIC_BLOCKING_FACTOR};
+        for (const auto &content : contents)
+        {
+            reference.add("name", content);
+        }
+    }
+    REQUIRE(result == expected.str());
+    REQUIRE(result.size() % (CLASSIC_BLOCKING_FACTOR * BLOCK_SIZE) == 0);
+}
+
+TEST_CASE("Entries queued on a file descriptor are written correctly.", "[tar][sink][writev]")
+{
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    auto result = std::string{};
+    auto reader = std::thread([&]() {
+        char buffer[4096];
+        ssize_t size;
+        while ((size = read(fds[0], buffer, sizeof(buffer))) > 0)
+        {
+            result.append(buffer, size);
+        }
+        close(fds[0]);
+    });
+
+    auto first = std::string{"content"};
+    auto second = std::string(1000, 'o');
+    {
+        auto tar = FdTar{fds[1]};
+        tar.queue("name", first);
+        tar.queue("other", second);
+    }
+    close(fds[1]);
+    reader.join();
+
+    REQUIRE(result == reference_tar());
+}
+
+TEST_CASE("Small queued entries are gathered into the record in progress.", "[tar][sink][writev][record]")
+{
+    using namespace details::constants;
+
+    auto result = std::string{};
+    auto tar = BasicTar<CountingSink>{CountingSink{&result, 0, 0}, CLASSIC_BLOCKING_FACTOR};
+    auto content = std::string{"content"};
+    tar.queue("first", content);
+    tar.flush_queue();
+    tar.queue("second", content);
+    tar.flush_queue();
+    REQUIRE(result.empty());
+    tar.finalize();
+
+    auto expected = std::stringstream{};
+    {
+        auto reference = Tar{expected, CLASSIC_BLOCKING_FACTOR};
+        reference.add("first", content);
+        reference.add("second", content);
+    }
+    REQUIRE(result == expected.str());
+}
+
+TEST_CASE("A tar can be written to a memory-mapped file.", "[tar][sink][mmap]")
+{
+    char path[] = "/tmp/tarpp-test-XXXXXX";
+    auto fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    REQUIRE(write(fd, "previous content", 16) == 16);
+
+    SECTION("With the planned size reserved.") {
+        auto planner = ArchivePlanner{};
+        planner.add("name", "content");
+        planner.add("other", std::string(1000, 'o'));
+        {
+            auto tar = BasicTar<sink::MmapSink>{sink::MmapSink{fd, planner.size()}};
+            add_reference_content(tar);
+            REQUIRE(tar.sink().size() == planner.size());
+        }
+    }
+
+    SECTION("Growing the file as needed.") {
+        auto tar = BasicTar<sink::MmapSink>{fd};
+        add_reference_content(tar);
+    }
+
+    auto result = std::string(reference_tar().size() + 1, '\0');
+    REQUIRE(pread(fd, &result[0], result.size(), 0) == (ssize_t)reference_tar().size());
+    result.resize(reference_tar().size());
+    REQUIRE(result == reference_tar());
+
+    close(fd);
+    unlink(path);
+}
+
+TEST_CASE("Memory-mapped archives are padded to whole records.", "[tar][sink][mmap][record]")
+{
+    using namespace details::constants;
+
+    char path[] = "/tmp/tarpp-test-XXXXXX";
+    auto fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    {
+        auto tar = BasicTar<sink::MmapSink>{fd, CLASSIC_BLOCKING_FACTOR};
+        tar.add("name", "content");
+    }
+
+    struct stat st{};
+    REQUIRE(fstat(fd, &st) == 0);
+    REQUIRE(st.st_size == CLASSIC_BLOCKING_FACTOR * BLOCK_SIZE);
+
+    close(fd);
+    unlink(path);
+}
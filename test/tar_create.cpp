@@ -1,12 +1,16 @@
 #include "catch/catch.hpp"
+#include <cstdlib>
 #include <sstream>
 #include <iostream>
+#include <thread>
 #include <unistd.h>
 
 #include "tarpp/tar.h"
 #include "tarpp/user.h"
+#include "helpers.h"
 
 using namespace tarpp;
+using namespace helpers;
 
 TEST_CASE("A tar file can be created from a ostream.", "[tar][create]")
 {
@@ -340,4 +344,881 @@ TEST_CASE("Tar contains content after header", "[tar][content]")
     auto tar_content_begin = std::next(result.begin(), details::constants::HEADER_SIZE);
     auto tar_content = std::string{tar_content_begin, std::next(tar_content_begin, content.size())};
     REQUIRE(tar_content == content);
-}
\ No newline at end of file
+}
+TEST_CASE("Content can be streamed from an input stream.", "[tar][add][stream]")
+{
+    using namespace details::constants;
+
+    auto content = std::string(3 * STREAM_CHUNK_SIZE + 17, 'a');
+    auto expected = std::stringstream{};
+    {
+        auto tar = Tar{expected};
+        tar.add("name", content);
+    }
+
+    auto out = std::stringstream{};
+    {
+        auto tar = Tar{out};
+        auto in = std::istringstream{content};
+        tar.add("name", in, content.size());
+    }
+
+    REQUIRE(out.str() == expected.str());
+}
+
+TEST_CASE("Content can be streamed from a file descriptor.", "[tar][add][stream]")
+{
+    auto content = std::string{"content"};
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    REQUIRE(write(fds[1], content.data(), content.size()) == (ssize_t)content.size());
+    close(fds[1]);
+
+    auto expected = std::stringstream{};
+    {
+        auto tar = Tar{expected};
+        tar.add("name", content);
+    }
+
+    auto out = std::stringstream{};
+    {
+        auto tar = Tar{out};
+        tar.add("name", fds[0], content.size());
+    }
+    close(fds[0]);
+
+    REQUIRE(out.str() == expected.str());
+}
+
+TEST_CASE("Streaming less content than declared completes the entry and throws.", "[tar][add][stream]")
+{
+    auto out = std::stringstream{};
+    auto tar = Tar{out};
+    auto in = std::istringstream{"short"};
+
+    REQUIRE_THROWS_AS(tar.add("name", in, 1000), const std::runtime_error &);
+    REQUIRE(out.str().size() == details::constants::HEADER_SIZE + 2 * details::constants::BLOCK_SIZE);
+}
+
+TEST_CASE("Files can be added from their path.", "[tar][add][file]")
+{
+    auto content = std::string(100000, 'f');
+    auto input = TempFile{};
+    REQUIRE(write(input.fd, content.data(), content.size()) == (ssize_t)content.size());
+
+    auto expected = std::stringstream{};
+    {
+        auto tar = Tar{expected};
+        tar.add("name", content);
+    }
+
+    SECTION("When writing to a stream.") {
+        auto out = std::stringstream{};
+        {
+            auto tar = Tar{out};
+            tar.add_file(input.path, "name");
+        }
+        REQUIRE(out.str() == expected.str());
+    }
+
+    SECTION("When writing to a file descriptor.") {
+        auto output = TempFile{};
+        {
+            auto tar = FdTar{output.fd};
+            tar.add_file(input.path, "name");
+        }
+        REQUIRE(read_fd(output.fd) == expected.str());
+    }
+
+    SECTION("When writing to a pipe.") {
+        int fds[2];
+        REQUIRE(pipe(fds) == 0);
+        auto result = std::string{};
+        auto reader = std::thread([&]() {
+            result = read_fd(fds[0]);
+            close(fds[0]);
+        });
+        {
+            auto tar = FdTar{fds[1]};
+            tar.add_file(input.path, "name");
+        }
+        close(fds[1]);
+        reader.join();
+        REQUIRE(result == expected.str());
+    }
+}
+
+TEST_CASE("Adding a file which does not exist throws.", "[tar][add][file]")
+{
+    auto out = std::stringstream{};
+    auto tar = Tar{out};
+
+    REQUIRE_THROWS_AS(tar.add_file("/does/not/exist", "name"), const std::system_error &);
+}
+
+TEST_CASE("Files with several hard links are added once.", "[tar][add][file][link]")
+{
+    auto content = std::string(1000, 'l');
+    auto input = TempFile{};
+    REQUIRE(write(input.fd, content.data(), content.size()) == (ssize_t)content.size());
+    auto link_path = input.path + "-link";
+    REQUIRE(link(input.path.c_str(), link_path.c_str()) == 0);
+
+    auto expected = std::stringstream{};
+    {
+        auto tar = Tar{expected};
+        tar.add("first", content);
+        tar.add("second", "", TarFileOptions{}.with_type(FileType::LINK).with_linkname("first"));
+    }
+
+    auto out = std::stringstream{};
+    {
+        auto tar = Tar{out};
+        tar.add_file(input.path, "first");
+        tar.add_file(link_path, "second");
+    }
+
+    SECTION("Files first added under a name too long for a link name are added with their content.") {
+        auto long_name = std::string(60, 'a') + "/" + std::string(60, 'b');
+        auto reference = std::stringstream{};
+        {
+            auto tar = Tar{reference};
+            tar.add(long_name, content);
+            tar.add("second", content);
+            tar.add("third", "", TarFileOptions{}.with_type(FileType::LINK).with_linkname("second"));
+        }
+
+        auto long_out = std::stringstream{};
+        {
+            auto tar = Tar{long_out};
+            tar.add_file(input.path, long_name);
+            tar.add_file(link_path, "second");
+            tar.add_file(input.path, "third");
+        }
+        REQUIRE(long_out.str() == reference.str());
+    }
+
+    SECTION("Files whose first entry failed are added with their content.") {
+        auto written = std::string{};
+        auto fail = true;
+        auto failing = sink::make_callback_sink([&written, &fail](const char *data, size_t size) {
+            if (fail) throw std::runtime_error("failing sink");
+            written.append(data, size);
+        });
+        auto reference = std::stringstream{};
+        {
+            auto tar = Tar{reference};
+            tar.add("second", content);
+        }
+
+        auto tar = BasicTar<decltype(failing)>{failing};
+        REQUIRE_THROWS_AS(tar.add_file(input.path, "first"), const std::runtime_error &);
+        fail = false;
+        tar.add_file(link_path, "second");
+        tar.finalize();
+        REQUIRE(written == reference.str());
+    }
+    unlink(link_path.c_str());
+
+    REQUIRE(out.str() == expected.str());
+}
+
+TEST_CASE("Archives are written in whole records.", "[tar][record]")
+{
+    using namespace details::constants;
+    constexpr size_t RECORD_SIZE = CLASSIC_BLOCKING_FACTOR * BLOCK_SIZE;
+
+    auto unbuffered = std::stringstream{};
+    {
+        auto tar = Tar{unbuffered};
+        tar.add("name", "content");
+        tar.add("big", std::string(3 * RECORD_SIZE + 5, 'b'));
+    }
+
+    auto write_sizes = std::vector<size_t>{};
+    auto result = std::string{};
+    {
+        auto sink = sink::make_callback_sink([&](const char *data, size_t size) {
+            write_sizes.push_back(size);
+            result.append(data, size);
+        });
+        auto tar = BasicTar<decltype(sink)>{sink, CLASSIC_BLOCKING_FACTOR};
+        tar.add("name", "content");
+        tar.add("big", std::string(3 * RECORD_SIZE + 5, 'b'));
+    }
+
+    SECTION("The archive is padded to a whole number of records.") {
+        REQUIRE(result.size() % RECORD_SIZE == 0);
+        REQUIRE(result.size() >= unbuffered.str().size());
+        REQUIRE(result.substr(0, unbuffered.str().size()) == unbuffered.str());
+        REQUIRE(std::all_of(std::next(result.begin(), unbuffered.str().size()), result.end(), [](char b){ return b == 0; }));
+    }
+
+    SECTION("Every write is made of whole records.") {
+        REQUIRE(std::all_of(write_sizes.begin(), write_sizes.end(), [](size_t size){ return size % RECORD_SIZE == 0; }));
+    }
+}
+
+TEST_CASE("Files copied by the kernel keep the archive record-aligned.", "[tar][record][file]")
+{
+    using namespace details::constants;
+    constexpr size_t RECORD_SIZE = CLASSIC_BLOCKING_FACTOR * BLOCK_SIZE;
+
+    auto content = std::string(2 * RECORD_SIZE + 700, 'f');
+    auto input = TempFile{};
+    REQUIRE(write(input.fd, content.data(), content.size()) == (ssize_t)content.size());
+
+    auto expected = std::stringstream{};
+    {
+        auto tar = Tar{expected, CLASSIC_BLOCKING_FACTOR};
+        tar.add("first", "content");
+        tar.add("name", content);
+    }
+
+    auto output = TempFile{};
+    {
+        auto tar = FdTar{output.fd, CLASSIC_BLOCKING_FACTOR};
+        tar.add("first", "content");
+        tar.add_file(input.path, "name");
+    }
+    REQUIRE(read_fd(output.fd) == expected.str());
+}
+
+TEST_CASE("A blocking factor of 0 is rejected.", "[tar][record]")
+{
+    auto out = std::stringstream{};
+    REQUIRE_THROWS_AS(Tar(out, 0), const std::invalid_argument &);
+}
+
+TEST_CASE("Entries can be added in batch.", "[tar][add][batch]")
+{
+    auto options = TarFileOptions{}.with_mtime(1234).with_mode(0644);
+    auto entries = std::vector<TarEntry>{
+        {"first", "content", options},
+        {"empty", "", options.with_type(FileType::DIRECTORY)},
+        {"big", std::string(3000, 'b'), options},
+        {"block", std::string(details::constants::BLOCK_SIZE, 'x'), options}
+    };
+
+    auto expected = std::stringstream{};
+    {
+        auto tar = Tar{expected};
+        tar.add("before", "content");
+        for (const auto &entry : entries)
+        {
+            tar.add(entry.name, entry.content, entry.options);
+        }
+    }
+
+    auto out = std::stringstream{};
+    {
+        auto tar = Tar{out};
+        tar.add("before", "content");
+        tar.add_batch(entries);
+    }
+
+    REQUIRE(out.str() == expected.str());
+}
+
+TEST_CASE("Entries can be written incrementally.", "[tar][add][entry]")
+{
+    auto content = std::string(3000, 'e');
+    auto expected = std::stringstream{};
+    {
+        auto tar = Tar{expected};
+        tar.add("name", content);
+        tar.add("after", "content");
+    }
+
+    auto out = std::stringstream{};
+    auto tar = Tar{out};
+
+    SECTION("Content written in chunks is the entry content.") {
+        {
+            auto entry = tar.begin_entry("name", content.size());
+            for (size_t i = 0; i < content.size(); i += 1000)
+            {
+                entry.write(content.substr(i, 1000));
+            }
+            REQUIRE(entry.remaining() == 0);
+        }
+        tar.add("after", "content");
+        tar.finalize();
+        REQUIRE(out.str() == expected.str());
+    }
+
+    SECTION("Writing more than the declared size throws.") {
+        auto entry = tar.begin_entry("name", 5);
+        entry.write("1234");
+        REQUIRE_THROWS_AS(entry.write("56"), const std::length_error &);
+        REQUIRE(entry.remaining() == 1);
+    }
+
+    SECTION("Closing an incomplete entry completes it with zeros and throws.") {
+        auto entry = tar.begin_entry("name", 1000);
+        entry.write("1234");
+        REQUIRE_THROWS_AS(entry.close(), const std::runtime_error &);
+        REQUIRE(out.str().size() == details::constants::HEADER_SIZE + 2 * details::constants::BLOCK_SIZE);
+    }
+
+    SECTION("The tar cannot be used while an entry is open.") {
+        auto entry = tar.begin_entry("name", 5);
+        REQUIRE_THROWS_AS(tar.add("other", "content"), const std::logic_error &);
+        REQUIRE_THROWS_AS(tar.finalize(), const std::logic_error &);
+        entry.write("12345");
+        entry.close();
+        REQUIRE_NOTHROW(tar.add("other", "content"));
+    }
+}
+
+TEST_CASE("A tar writing entries with writev cannot be used while an entry is open.", "[tar][add][entry][writev]")
+{
+    auto output = TempFile{};
+    auto tar = FdTar{output.fd};
+    auto entry = tar.begin_entry("name", 5);
+    REQUIRE_THROWS_AS(tar.add("other", "content"), const std::logic_error &);
+    REQUIRE_THROWS_AS(tar.queue("other", "content"), const std::logic_error &);
+    entry.write("12345");
+    entry.close();
+    REQUIRE_NOTHROW(tar.add("other", "content"));
+}
+
+template<typename EntryWriter>
+void write_in_chunks(EntryWriter entry, const std::string &content)
+{
+    for (size_t i = 0; i < content.size(); i += 100000)
+    {
+        entry.write(content.substr(i, 100000));
+    }
+    entry.close();
+}
+
+TEST_CASE("Entries of unknown size can be written incrementally.", "[tar][add][entry]")
+{
+    auto content = std::string(2 * 1024 * 1024 + 100, 'u');
+    auto expected = std::stringstream{};
+    {
+        auto tar = Tar{expected};
+        tar.add("name", content);
+        tar.add("after", "content");
+    }
+
+    SECTION("The header is patched on a seekable stream.") {
+        auto out = std::stringstream{};
+        {
+            auto tar = Tar{out};
+            write_in_chunks(tar.begin_entry("name"), content);
+            tar.add("after", "content");
+        }
+        REQUIRE(out.str() == expected.str());
+    }
+
+    SECTION("The header is patched in the record buffer.") {
+        auto reference = std::stringstream{};
+        {
+            auto tar = Tar{reference, details::constants::CLASSIC_BLOCKING_FACTOR};
+            tar.add("small", "content");
+        }
+        auto out = std::stringstream{};
+        {
+            auto tar = Tar{out, details::constants::CLASSIC_BLOCKING_FACTOR};
+            auto entry = tar.begin_entry("small");
+            entry.write("content");
+        }
+        REQUIRE(out.str() == reference.str());
+    }
+
+    SECTION("The header is patched in a file.") {
+        auto output = TempFile{};
+        {
+            auto tar = FdTar{output.fd};
+            write_in_chunks(tar.begin_entry("name"), content);
+            tar.add("after", "content");
+        }
+        lseek(output.fd, 0, SEEK_SET);
+        REQUIRE(read_fd(output.fd) == expected.str());
+    }
+
+    auto out = std::string{};
+    auto sink = sink::make_callback_sink([&out](const char *data, size_t size) { out.append(data, size); });
+    auto tar = BasicTar<decltype(sink)>{sink};
+
+    SECTION("The content is spilled when the sink is not seekable.") {
+        write_in_chunks(tar.begin_entry("name"), content);
+        tar.add("after", "content");
+        tar.finalize();
+        REQUIRE(out == expected.str());
+    }
+
+    SECTION("Spilled content is limited.") {
+        tar.set_spill_limit(10);
+        auto entry = tar.begin_entry("name");
+        entry.write("1234567890");
+        REQUIRE_THROWS_AS(entry.write("1"), const std::length_error &);
+        entry.close();
+        tar.finalize();
+        REQUIRE(out.size() == details::constants::HEADER_SIZE + 3 * details::constants::BLOCK_SIZE);
+    }
+}
+
+TEST_CASE("Identical contents are added as links when deduplication is enabled.", "[tar][add][dedup]")
+{
+    auto content = std::string(3000, 'd');
+    auto other = std::string(3000, 'o');
+    auto link = TarFileOptions{}.with_type(FileType::LINK).with_linkname("first");
+
+    auto deduplicated = std::stringstream{};
+    {
+        auto tar = Tar{deduplicated};
+        tar.add("first", content);
+        tar.add("other", other);
+        tar.add("second", "", link);
+    }
+
+    auto out = std::stringstream{};
+    auto tar = Tar{out};
+
+    SECTION("Deduplication is disabled by default.") {
+        tar.add("first", content);
+        tar.add("other", other);
+        tar.add("second", content);
+        tar.finalize();
+        REQUIRE(out.str().size() == deduplicated.str().size() + content.size() + details::padding_size(content.size()));
+    }
+
+    SECTION("Added entries are deduplicated.") {
+        tar.set_dedup_index_size(1024 * 1024);
+        tar.add("first", content);
+        tar.add("other", other);
+        tar.add("second", content);
+        tar.finalize();
+        REQUIRE(out.str() == deduplicated.str());
+    }
+
+    SECTION("Queued entries are deduplicated.") {
+        tar.set_dedup_index_size(1024 * 1024);
+        tar.queue("first", content);
+        tar.queue("other", other);
+        tar.queue("second", content);
+        tar.finalize();
+        REQUIRE(out.str() == deduplicated.str());
+    }
+
+    SECTION("The oldest contents are forgotten when the index is full.") {
+        tar.set_dedup_index_size(4000);
+        tar.add("first", content);
+        tar.add("other", other);
+        tar.add("second", content);
+        tar.add("third", content);
+        tar.finalize();
+
+        auto expected = std::stringstream{};
+        {
+            auto reference = Tar{expected};
+            reference.add("first", content);
+            reference.add("other", other);
+            reference.add("second", content);
+            reference.add("third", "", link.with_linkname("second"));
+        }
+        REQUIRE(out.str() == expected.str());
+    }
+
+    SECTION("Entries with the same content but other attributes keep their content.") {
+        auto executable = TarFileOptions{}.with_mode(0755);
+        tar.set_dedup_index_size(1024 * 1024);
+        tar.add("first", content);
+        tar.add("script", content, executable);
+        tar.add("other owner", content, TarFileOptions{}.with_uid(4242));
+        tar.add("second", content);
+        tar.finalize();
+
+        auto expected = std::stringstream{};
+        {
+            auto reference = Tar{expected};
+            reference.add("first", content);
+            reference.add("script", content, executable);
+            reference.add("other owner", content, TarFileOptions{}.with_uid(4242));
+            reference.add("second", "", link);
+        }
+        REQUIRE(out.str() == expected.str());
+    }
+
+    SECTION("Entries whose name does not fit in a link name are not linked to.") {
+        auto long_name = std::string(60, 'a') + "/" + std::string(60, 'b');
+        tar.set_dedup_index_size(1024 * 1024);
+        tar.add(long_name, content);
+        tar.add("second", content);
+        tar.finalize();
+
+        auto expected = std::stringstream{};
+        {
+            auto reference = Tar{expected};
+            reference.add(long_name, content);
+            reference.add("second", content);
+        }
+        REQUIRE(out.str() == expected.str());
+    }
+
+    SECTION("Formats storing long link names link to entries with long names.") {
+        auto long_name = std::string(60, 'a') + "/" + std::string(60, 'b');
+        auto gnu = std::stringstream{};
+        {
+            auto gnu_tar = BasicTar<sink::OStreamSink, GnuFormat>{gnu};
+            gnu_tar.set_dedup_index_size(1024 * 1024);
+            gnu_tar.add(long_name, content);
+            gnu_tar.add("second", content);
+        }
+
+        auto expected = std::stringstream{};
+        {
+            auto reference = BasicTar<sink::OStreamSink, GnuFormat>{expected};
+            reference.add(long_name, content);
+            reference.add("second", "", link.with_linkname(long_name));
+        }
+        REQUIRE(gnu.str() == expected.str());
+    }
+}
+
+TEST_CASE("Sparse files are added without their holes.", "[tar][add][file][sparse]")
+{
+    using namespace details::constants;
+
+    auto input = TempFile{};
+    REQUIRE(ftruncate(input.fd, 1024 * 1024) == 0);
+    REQUIRE(pwrite(input.fd, "head", 4, 0) == 4);
+    REQUIRE(pwrite(input.fd, "middle", 6, 600000) == 6);
+
+    auto segments = io::data_segments(input.fd, 1024 * 1024);
+    if (segments.size() < 2)
+    {
+        WARN("The file system of /tmp does not report holes.");
+        return;
+    }
+
+    auto out = std::stringstream{};
+    {
+        auto tar = Tar{out};
+        tar.add_sparse_file(input.path, "sparse");
+    }
+    auto archive = out.str();
+
+    auto pax_header = archive.substr(0, HEADER_SIZE);
+    REQUIRE(pax_header.substr(0, 21) == std::string("./PaxHeaders.0/sparse", 21));
+    REQUIRE(pax_header[156] == 'x');
+    auto records = archive.substr(HEADER_SIZE, BLOCK_SIZE);
+    REQUIRE(records.find("22 GNU.sparse.major=1\n22 GNU.sparse.minor=0\n") == 0);
+    REQUIRE(records.find("26 GNU.sparse.name=sparse\n") != std::string::npos);
+    REQUIRE(records.find("31 GNU.sparse.realsize=1048576\n") != std::string::npos);
+
+    auto header = archive.substr(HEADER_SIZE + BLOCK_SIZE, HEADER_SIZE);
+    REQUIRE(header.substr(0, 24) == "./GNUSparseFile.0/sparse");
+    REQUIRE(header[156] == '0');
+
+    auto map = std::to_string(segments.size() + (segments.back().offset + segments.back().size < 1024 * 1024)) + "\n";
+    auto data = std::string{};
+    for (const auto &segment : segments)
+    {
+        map += std::to_string(segment.offset) + "\n" + std::to_string(segment.size) + "\n";
+        auto content = std::string(segment.size, '\0');
+        REQUIRE(pread(input.fd, &content[0], content.size(), segment.offset) == (ssize_t)content.size());
+        data += content;
+    }
+    if (segments.back().offset + segments.back().size < 1024 * 1024)
+    {
+        map += "1048576\n0\n";
+    }
+    auto content = archive.substr(2 * HEADER_SIZE + BLOCK_SIZE);
+    REQUIRE(content.substr(0, map.size()) == map);
+    REQUIRE(content.substr(BLOCK_SIZE, data.size()) == data);
+    REQUIRE(archive.size() < 1024 * 1024 / 2);
+}
+
+TEST_CASE("Empty files added as sparse files are regular entries.", "[tar][add][file][sparse]")
+{
+    auto input = TempFile{};
+    auto expected = std::stringstream{};
+    {
+        auto tar = Tar{expected};
+        tar.add("empty", "");
+    }
+
+    auto out = std::stringstream{};
+    {
+        auto tar = Tar{out};
+        tar.add_sparse_file(input.path, "empty");
+    }
+    REQUIRE(out.str() == expected.str());
+}
+
+namespace {
+
+/**
+ * Archive a sparse file between other entries in the given format, extract it with the system tar and check every
+ * entry comes back.
+ */
+template<typename Format>
+void require_sparse_file_extracts(const std::string &sparse_name, const TarFileOptions &options)
+{
+    // Enough data segments for the map not to fit in a GNU header.
+    auto input = TempFile{};
+    REQUIRE(ftruncate(input.fd, 1024 * 1024) == 0);
+    for (auto i = 0; i < 30; ++i)
+    {
+        REQUIRE(pwrite(input.fd, "data", 4, i * 32768) == 4);
+    }
+    auto expected = read_fd(input.fd);
+
+    auto archive = TempFile{};
+    {
+        auto tar = BasicTar<sink::FdSink, Format>{archive.fd};
+        tar.add("first", "first content");
+        tar.add_sparse_file(input.path, sparse_name, options);
+        tar.add("plain", "plain content");
+    }
+
+    char directory[] = "/tmp/tarpp-extract-XXXXXX";
+    REQUIRE(mkdtemp(directory) != nullptr);
+    auto command = std::string{"tar --no-same-owner -xf "} + archive.path + " -C " + directory;
+    REQUIRE(std::system(command.c_str()) == 0);
+
+    CHECK(read_path(std::string{directory} + "/first") == "first content");
+    CHECK(read_path(std::string{directory} + "/" + sparse_name) == expected);
+    CHECK(read_path(std::string{directory} + "/plain") == "plain content");
+
+    std::system((std::string{"rm -rf "} + directory).c_str());
+}
+
+}
+
+TEST_CASE("Sparse files can be extracted in every format.", "[tar][add][file][sparse][format]")
+{
+    if (std::system("tar --version > /dev/null 2>&1") != 0)
+    {
+        WARN("tar is not available.");
+        return;
+    }
+
+    auto options = TarFileOptions{}.with_mode(0644);
+    auto long_name = std::string(150, 's');
+
+    SECTION("V7") {
+        require_sparse_file_extracts<V7Format>("sparse", options);
+    }
+
+    SECTION("Ustar") {
+        require_sparse_file_extracts<UstarFormat>("sparse", options);
+    }
+
+    SECTION("GNU") {
+        require_sparse_file_extracts<GnuFormat>(long_name, options.with_uid(3000000));
+    }
+
+    SECTION("Pax, with records for the entry itself.") {
+        require_sparse_file_extracts<PaxFormat>(long_name,
+                                                options.with_uid(3000000).with_username(std::string(40, 'u')));
+    }
+}
+
+TEST_CASE("Files without holes are added as regular files.", "[tar][add][file][sparse]")
+{
+    auto content = std::string(10000, 's');
+    auto input = TempFile{};
+    REQUIRE(write(input.fd, content.data(), content.size()) == (ssize_t)content.size());
+
+    auto expected = std::stringstream{};
+    {
+        auto tar = Tar{expected};
+        tar.add("name", content);
+    }
+
+    auto out = std::stringstream{};
+    {
+        auto tar = Tar{out};
+        tar.add_sparse_file(input.path, "name");
+    }
+    REQUIRE(out.str() == expected.str());
+}
+
+namespace {
+
+template<typename Format>
+void require_prototype_matches_format_header()
+{
+    auto options = TarFileOptions{};
+    auto names = {std::string{"name"}, std::string(100, 'n'), std::string(180, 'l'), std::string{"caf\xc3\xa9"},
+                  std::string(120, 'p') + "/" + std::string(29, 'n'), std::string(30, 'p') + "/" + std::string(99, 'n')};
+    auto variants = {options, options.with_mtime(1234567890), options.with_mode(0644),
+                     options.with_username("someone"), options.with_type(FileType::SIMLINK).with_linkname("target"),
+                     options.with_mtime(077777777777)};
+
+    auto prototype = details::HeaderPrototype<Format>{};
+    for (const auto &variant : variants)
+    {
+        for (const auto &name : names)
+        {
+            for (auto size : {size_t{0}, size_t{1000}, size_t{077777777777}})
+            {
+                auto expected = details::TarHeader{};
+                auto header = details::TarHeader{};
+                try
+                {
+                    details::format_header<Format>(expected, name, size, variant);
+                }
+                catch (const std::length_error &)
+                {
+                    REQUIRE_THROWS_AS(prototype.format(header, name, size, variant), const std::length_error &);
+                    continue;
+                }
+                prototype.format(header, name, size, variant);
+                REQUIRE(std::equal(std::begin(header.data_), std::end(header.data_), std::begin(expected.data_)));
+                REQUIRE(details::verify_checksum(header));
+            }
+        }
+    }
+}
+
+}
+
+TEST_CASE("Headers formatted from a prototype are identical to fully formatted ones.", "[tar][header]")
+{
+    SECTION("V7") {
+        require_prototype_matches_format_header<V7Format>();
+    }
+
+    SECTION("Ustar") {
+        require_prototype_matches_format_header<UstarFormat>();
+    }
+
+    SECTION("GNU") {
+        require_prototype_matches_format_header<GnuFormat>();
+    }
+
+    SECTION("Pax") {
+        require_prototype_matches_format_header<PaxFormat>();
+    }
+}
+
+namespace {
+
+template<typename Format>
+std::string archive_with_format(const std::string &tar_name, const TarFileOptions &options)
+{
+    auto out = std::stringstream{};
+    {
+        auto tar = BasicTar<sink::OStreamSink, Format>{out};
+        tar.add(tar_name, "content", options);
+    }
+    return out.str();
+}
+
+details::TarHeader header_at(const std::string &archive, size_t offset)
+{
+    auto header = details::TarHeader{};
+    archive.copy(header.data_, details::constants::HEADER_SIZE, offset);
+    return header;
+}
+
+}
+
+TEST_CASE("Archives can be written in the V7, ustar, GNU and pax formats.", "[tar][header][format]")
+{
+    using namespace details::constants;
+    auto options = TarFileOptions{};
+    auto long_name = std::string(150, 'l');
+
+    SECTION("V7 headers have no magic and reject what they cannot store.") {
+        auto header = header_at(archive_with_format<V7Format>("name", options), 0);
+        REQUIRE(details::verify_checksum(header));
+        REQUIRE(std::all_of(std::begin(header.header_.magic_), std::end(header.header_.magic_),
+                            [](char c) { return c == '\0'; }));
+        REQUIRE(std::all_of(std::begin(header.header_.uname_), std::end(header.header_.uname_),
+                            [](char c) { return c == '\0'; }));
+        REQUIRE_THROWS_AS(archive_with_format<V7Format>(long_name, options), const std::length_error &);
+    }
+
+    SECTION("Ustar headers reject numbers which do not fit.") {
+        REQUIRE_THROWS_AS(archive_with_format<UstarFormat>("name", options.with_uid(010000000)),
+                          const std::length_error &);
+        REQUIRE_THROWS_AS(archive_with_format<UstarFormat>("name", options.with_mtime(-1)),
+                          const std::length_error &);
+    }
+
+    SECTION("GNU long names are written in entries before the header.") {
+        auto link_target = std::string(120, 't');
+        auto result = archive_with_format<GnuFormat>(long_name, options.with_linkname(link_target));
+
+        auto link = header_at(result, 0);
+        REQUIRE(link.header_.type_[0] == 'K');
+        REQUIRE(std::string{link.header_.name_} == "././@LongLink");
+        REQUIRE(result.compare(HEADER_SIZE, link_target.size() + 1, link_target.c_str(), link_target.size() + 1) == 0);
+
+        auto name = header_at(result, 2 * HEADER_SIZE);
+        REQUIRE(name.header_.type_[0] == 'L');
+        REQUIRE(result.compare(3 * HEADER_SIZE, long_name.size(), long_name) == 0);
+
+        auto header = header_at(result, 4 * HEADER_SIZE);
+        REQUIRE(details::verify_checksum(header));
+        REQUIRE(std::string(header.header_.magic_, HEADER_MAGIC_SIZE + HEADER_VERSION_SIZE) ==
+                std::string("ustar  \0", 8));
+        REQUIRE(result.compare(5 * HEADER_SIZE, 7, "content") == 0);
+    }
+
+    SECTION("GNU headers hold large numbers in base-256.") {
+        auto header = details::TarHeader{};
+        details::format_header<GnuFormat>(header, "big", size_t{1} << 36, options.with_uid(010000000).with_mtime(-1));
+        REQUIRE(details::verify_checksum(header));
+        REQUIRE(std::string(header.header_.size_, HEADER_SIZE_SIZE) ==
+                std::string("\x80\0\0\0\0\0\0\x10\0\0\0\0", HEADER_SIZE_SIZE));
+        REQUIRE(std::string(header.header_.uid_, HEADER_UID_SIZE) ==
+                std::string("\x80\0\0\0\0\x20\0\0", HEADER_UID_SIZE));
+        REQUIRE(std::string(header.header_.mtime_, HEADER_MTIME_SIZE) == std::string(HEADER_MTIME_SIZE, '\xff'));
+
+        details::format_header<GnuFormat>(header, "small", 077777777777, options);
+        REQUIRE(std::string{header.header_.size_} == "77777777777");
+    }
+
+    SECTION("Pax records hold what the ustar header cannot store.") {
+        auto result = archive_with_format<PaxFormat>(long_name, options.with_uid(010000000));
+
+        auto extended = header_at(result, 0);
+        REQUIRE(extended.header_.type_[0] == 'x');
+        REQUIRE(details::verify_checksum(extended));
+        auto records = details::pax_record("path", long_name) + details::pax_record("uid", "2097152");
+        REQUIRE(result.compare(HEADER_SIZE, records.size(), records) == 0);
+
+        auto header = header_at(result, 2 * HEADER_SIZE);
+        REQUIRE(details::verify_checksum(header));
+        REQUIRE(std::string{header.header_.magic_} == "ustar");
+    }
+
+    SECTION("Pax headers are only written when needed.") {
+        auto name = std::string(50, 'd') + "/" + std::string(99, 'n');
+        auto result = archive_with_format<PaxFormat>(name, options);
+        auto header = header_at(result, 0);
+        REQUIRE(header.header_.type_[0] == '0');
+        REQUIRE(std::string(header.header_.prefix_) == std::string(50, 'd'));
+        REQUIRE(std::string(header.header_.name_, HEADER_NAME_SIZE).compare(0, 99, std::string(99, 'n')) == 0);
+    }
+
+    SECTION("Device numbers are written for devices only.") {
+        auto device = options.with_type(FileType::BLOCK_SPECIAL_DEVICE).with_device(8, 17);
+        auto header = header_at(archive_with_format<UstarFormat>("sda1", device), 0);
+        REQUIRE(details::verify_checksum(header));
+        REQUIRE(std::string(header.header_.devmajor_, HEADER_DEVMAJOR_SIZE) == std::string("0000010\0", 8));
+        REQUIRE(std::string(header.header_.devminor_, HEADER_DEVMINOR_SIZE) == std::string("0000021\0", 8));
+
+        header = header_at(archive_with_format<UstarFormat>("file", options.with_device(8, 17)), 0);
+        REQUIRE(std::string(header.header_.devmajor_, HEADER_DEVMAJOR_SIZE) == std::string(8, '\0'));
+
+        header = header_at(archive_with_format<GnuFormat>("sda1", device), 0);
+        REQUIRE(std::string(header.header_.devminor_, HEADER_DEVMINOR_SIZE) == std::string("0000021\0", 8));
+
+        REQUIRE_THROWS_AS(archive_with_format<V7Format>("sda1", device), const std::length_error &);
+        REQUIRE_THROWS_AS(archive_with_format<UstarFormat>("big", device.with_device(010000000, 0)),
+                          const std::length_error &);
+
+        auto result = archive_with_format<PaxFormat>("big", device.with_device(010000000, 0));
+        auto records = details::pax_record("SCHILY.devmajor", "2097152");
+        REQUIRE(result.compare(HEADER_SIZE, records.size(), records) == 0);
+    }
+}
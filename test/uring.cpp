@@ -0,0 +1,68 @@
+#include "catch/catch.hpp"
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "tarpp/tar.h"
+#include "tarpp/uring.h"
+#include "helpers.h"
+
+using namespace tarpp;
+using namespace helpers;
+
+TEST_CASE("A tar can be written with io_uring.", "[tar][sink][uring]")
+{
+    auto big = std::string(100000, 'b');
+    for (size_t i = 0; i < big.size(); ++i)
+    {
+        big[i] = static_cast<char>('a' + i % 26);
+    }
+    auto input = TempFile{};
+    REQUIRE(write(input.fd, big.data(), big.size()) == (ssize_t)big.size());
+
+    auto expected = std::stringstream{};
+    {
+        auto tar = Tar{expected};
+        tar.add("name", "content");
+        tar.add("big", big);
+        tar.add("other", std::string(1000, 'o'));
+        tar.add("big again", big);
+    }
+
+    auto output = TempFile{};
+    {
+        auto tar = BasicTar<sink::UringSink>{sink::UringSink{output.fd, 4, 4096}};
+        tar.add("name", "content");
+        tar.add_file(input.path, "big");
+        tar.add("other", std::string(1000, 'o'));
+        tar.add_file(input.path, "big again");
+    }
+
+    REQUIRE(read_fd(output.fd) == expected.str());
+}
+
+TEST_CASE("Missing source content is reported when the io_uring sink finishes.", "[tar][sink][uring]")
+{
+    auto input = TempFile{};
+    REQUIRE(write(input.fd, "short", 5) == 5);
+    REQUIRE(lseek(input.fd, 0, SEEK_SET) == 0);
+
+    auto output = TempFile{};
+    auto sink = sink::UringSink{output.fd, 2, 4096};
+    sink.copy_from(input.fd, 10000);
+
+    REQUIRE_THROWS_AS(sink.finish(), const std::runtime_error &);
+    auto result = read_fd(output.fd);
+    REQUIRE(result.size() == 10000);
+    REQUIRE(result.substr(0, 5) == "short");
+    REQUIRE(std::all_of(std::next(result.begin(), 5), result.end(), [](char b){ return b == 0; }));
+}
+
+TEST_CASE("io_uring sinks need a seekable output.", "[tar][sink][uring]")
+{
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    REQUIRE_THROWS_AS(sink::UringSink{fds[1]}, const std::system_error &);
+    close(fds[0]);
+    close(fds[1]);
+}